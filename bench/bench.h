@@ -0,0 +1,30 @@
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include "helper.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_START(name, Max_Blocks)                                                                                  \
+    void bench_##name()                                                                                                \
+    {                                                                                                                  \
+        printf("\n-> Started benchmark %s\n", #name);                                                                  \
+        const size_t MEMORY_SIZE = (Max_Blocks);                                                                       \
+        void *_ptr = malloc(MEMORY_SIZE * BLOCK_SIZE);                                                                 \
+        kmem_init(_ptr, MEMORY_SIZE);
+
+#define BENCH_END                                                                                                      \
+    buddy_destroy();                                                                                                   \
+    free(_ptr);                                                                                                        \
+    printf("Done\n");                                                                                                  \
+    }
+
+#define BENCH_ADD(name)                                                                                                \
+    void bench_##name();                                                                                               \
+    bench_##name();
+
+#define bench_ns(startTicks, endTicks) ((double)((endTicks) - (startTicks)) * 1e9 / read_timestamp_frequency())
+
+#define bench_report(what, ns, ops) printf("%-40s %12.2f ns/op (%llu ops)\n", what, (ns) / (ops), (unsigned long long)(ops))
+
+#endif // __BENCH_H
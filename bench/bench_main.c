@@ -0,0 +1,16 @@
+#include "bench.h"
+
+int main(int argc, char const *argv[])
+{
+    BENCH_ADD(false_sharing);
+    BENCH_ADD(coloring);
+    BENCH_ADD(slab_refill);
+    BENCH_ADD(slab_free);
+    BENCH_ADD(buddy_hot);
+    BENCH_ADD(fragmentation);
+    BENCH_ADD(zalloc);
+    BENCH_ADD(typed_cache);
+    BENCH_ADD(kmalloc_class);
+    BENCH_ADD(thread_cache);
+    return 0;
+}
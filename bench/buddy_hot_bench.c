@@ -0,0 +1,47 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// Slab style churn on the buddy allocator, with and without hot caches
+
+#define CHURN_ITER 100000
+#define CHURN_BATCH 8
+
+static void churn_run(size_t watermark)
+{
+    char what[64];
+    void *ptr[CHURN_BATCH];
+    buddy_stats_t before, after;
+
+    buddy_hot_cache_set(watermark);
+    buddy_get_stats(&before);
+
+    const uint64_t start = read_timestamp();
+    for (int i = 0; i < CHURN_ITER; i++)
+    {
+        for (int j = 0; j < CHURN_BATCH; j++)
+            buddy_alloc((j & 1 ? 2 : 1) * BLOCK_SIZE, &ptr[j]);
+        for (int j = 0; j < CHURN_BATCH; j++)
+            buddy_free(ptr[j]);
+    }
+    const double ns = bench_ns(start, read_timestamp());
+
+    buddy_hot_cache_drain();
+    buddy_get_stats(&after);
+
+    const uint64_t ops = (uint64_t)CHURN_ITER * CHURN_BATCH * 2;
+    sprintf_s(what, sizeof(what), "Buddy churn, watermark %llu", (unsigned long long)watermark);
+    bench_report(what, ns, ops);
+    const uint64_t work = after.splits + after.merges - before.splits - before.merges;
+    printf("%-40s %12.2f splits+merges/op, %llu hot hits\n", "", (double)work / ops,
+           (unsigned long long)(after.hotHits - before.hotHits));
+}
+
+BENCH_START(buddy_hot, 4096)
+{
+    churn_run(0);
+    churn_run(8);
+    churn_run(32);
+    buddy_hot_cache_set(0);
+}
+BENCH_END
@@ -0,0 +1,64 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// Chases pointers stored in the first object of every slab. Without coloring
+// all of them sit at the same page offset and fight for the same cache sets.
+
+#define COLOR_OBJECT_SIZE 700
+#define COLOR_SLABS 512
+#define COLOR_HOPS (1 << 24)
+
+static void *volatile s_colorSink;
+
+static void color_chase(kmem_cache_t *cache, const char *what)
+{
+    void **hot = (void **)malloc(COLOR_SLABS * sizeof(void *));
+    for (int s = 0; s < COLOR_SLABS; s++)
+    {
+        do
+        {
+            kmem_cache_alloc(cache);
+        } while (cache->pSlab[FULL] == NULL || (s > 0 && cache->pSlab[FULL]->memStart == hot[s - 1]));
+        hot[s] = cache->pSlab[FULL]->memStart;
+    }
+
+    // Random cycle through all hot objects
+    srand(1);
+    for (int s = COLOR_SLABS - 1; s > 0; s--)
+    {
+        const int r = rand() % (s + 1);
+        void *tmp = hot[s];
+        hot[s] = hot[r];
+        hot[r] = tmp;
+    }
+    for (int s = 0; s < COLOR_SLABS; s++)
+        *(void **)hot[s] = hot[(s + 1) % COLOR_SLABS];
+
+    void *curr = hot[0];
+    const uint64_t start = read_timestamp();
+    for (int i = 0; i < COLOR_HOPS; i++)
+        curr = *(void **)curr;
+    bench_report(what, bench_ns(start, read_timestamp()), COLOR_HOPS);
+    s_colorSink = curr;
+
+    free(hot);
+}
+
+BENCH_START(coloring, 4096)
+{
+    kmem_cache_t *none = kmem_cache_create_aligned("ColorNone", COLOR_OBJECT_SIZE, 0, SLAB_NO_COLOR, NULL, NULL);
+    kmem_cache_t *l1 = kmem_cache_create("ColorL1", COLOR_OBJECT_SIZE, NULL, NULL);
+    kmem_cache_t *l2 = kmem_cache_create_aligned("ColorL2", COLOR_OBJECT_SIZE, 0, SLAB_L2_COLOR, NULL, NULL);
+
+    printf("Colors per slab: %llu, stride %llu\n", (unsigned long long)l1->layout.colorCount,
+           (unsigned long long)l1->layout.colorStride);
+    color_chase(none, "Pointer chase, no coloring");
+    color_chase(l1, "Pointer chase, L1 coloring");
+    color_chase(l2, "Pointer chase, L2 aware coloring");
+
+    kmem_cache_destroy(none);
+    kmem_cache_destroy(l1);
+    kmem_cache_destroy(l2);
+}
+BENCH_END
@@ -0,0 +1,109 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+#include <windows.h>
+
+// Threads on different CPUs allocate small objects from one cache in lockstep
+// and then hammer their own objects. Objects of different threads sharing a
+// cache line show up as shared lines and as slower increments.
+
+#define FS_THREADS 4
+#define FS_OBJECTS 64
+#define FS_OBJECT_SIZE 16
+#define FS_ITER 200000
+
+typedef struct fs_thread_struct
+{
+    kmem_cache_t *cache;
+    int id;
+    int cpu;
+    volatile size_t *objects[FS_OBJECTS];
+    uint64_t ticks;
+} fs_thread_t;
+
+static volatile LONG s_turn;
+static volatile LONG s_ready;
+
+static DWORD WINAPI fs_thread_main(LPVOID arg)
+{
+    fs_thread_t *thread = (fs_thread_t *)arg;
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << thread->cpu);
+
+    for (int i = 0; i < FS_OBJECTS; i++)
+    {
+        while (s_turn != i * FS_THREADS + thread->id)
+            ;
+        thread->objects[i] = (volatile size_t *)kmem_cache_alloc(thread->cache);
+        *thread->objects[i] = 0;
+        InterlockedIncrement(&s_turn);
+    }
+
+    InterlockedIncrement(&s_ready);
+    while (s_ready != FS_THREADS)
+        ;
+
+    const uint64_t start = read_timestamp();
+    for (int it = 0; it < FS_ITER; it++)
+        for (int i = 0; i < FS_OBJECTS; i++)
+            (*thread->objects[i])++;
+    thread->ticks = read_timestamp() - start;
+
+    return 0;
+}
+
+static int fs_owner_of_line(fs_thread_t *threads, size_t line, int except)
+{
+    for (int t = 0; t < FS_THREADS; t++)
+    {
+        if (t == except)
+            continue;
+        for (int i = 0; i < FS_OBJECTS; i++)
+            if ((size_t)threads[t].objects[i] / CACHE_L1_LINE_SIZE == line)
+                return t;
+    }
+    return -1;
+}
+
+BENCH_START(false_sharing, 4096)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    fs_thread_t threads[FS_THREADS];
+    HANDLE handles[FS_THREADS];
+    kmem_cache_t *cache = kmem_cache_create("FalseSharing", FS_OBJECT_SIZE, NULL, NULL);
+    s_turn = 0;
+    s_ready = 0;
+
+    for (int t = 0; t < FS_THREADS; t++)
+    {
+        threads[t].cache = cache;
+        threads[t].id = t;
+        threads[t].cpu = t % info.dwNumberOfProcessors;
+        handles[t] = CreateThread(NULL, 0, fs_thread_main, &threads[t], 0, NULL);
+    }
+    for (int t = 0; t < FS_THREADS; t++)
+    {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+    }
+
+    int sharedObjects = 0;
+    double ns = 0;
+    for (int t = 0; t < FS_THREADS; t++)
+    {
+        for (int i = 0; i < FS_OBJECTS; i++)
+            sharedObjects += fs_owner_of_line(threads, (size_t)threads[t].objects[i] / CACHE_L1_LINE_SIZE, t) != -1;
+        ns += bench_ns(0, threads[t].ticks);
+    }
+
+    printf("CPUs: %lu, per CPU slots: %d\n", (unsigned long)info.dwNumberOfProcessors, KMEM_MAX_CPUS);
+    printf("Objects on a line shared with another thread: %d / %d\n", sharedObjects, FS_THREADS * FS_OBJECTS);
+    bench_report("Increment own object", ns, (uint64_t)FS_THREADS * FS_OBJECTS * FS_ITER);
+
+    for (int t = 0; t < FS_THREADS; t++)
+        for (int i = 0; i < FS_OBJECTS; i++)
+            kmem_cache_free(cache, (void *)threads[t].objects[i]);
+    kmem_cache_destroy(cache);
+}
+BENCH_END
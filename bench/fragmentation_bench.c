@@ -0,0 +1,85 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// Slabs a cache holds for its live objects after random frees followed by churn
+
+#define FRAG_OBJECTS 60000
+#define FRAG_ROUNDS 20
+
+static int frag_count_slabs(kmem_slab_t *head)
+{
+    int cnt = 0;
+    for (; head; head = head->next)
+        cnt++;
+    return cnt;
+}
+
+static void frag_run(size_t objSize, int freePercent)
+{
+    char what[64];
+    void **ptr = malloc(FRAG_OBJECTS * sizeof(void *));
+    kmem_cache_t *cache = kmem_cache_create("Fragmentation", objSize, NULL, NULL);
+
+    srand(7);
+    for (int i = 0; i < FRAG_OBJECTS; i++)
+        ptr[i] = kmem_cache_alloc(cache);
+
+    for (int i = 0; i < FRAG_OBJECTS; i++)
+    {
+        if (rand() % 100 < freePercent)
+        {
+            kmem_cache_free(cache, ptr[i]);
+            ptr[i] = NULL;
+        }
+    }
+
+    // Churn keeps the live set size, each round allocates into the holes and frees random live objects
+    for (int round = 0; round < FRAG_ROUNDS; round++)
+    {
+        int churn = 0;
+        for (int i = 0; i < FRAG_OBJECTS && churn < FRAG_OBJECTS / FRAG_ROUNDS; i++)
+        {
+            if (!ptr[i] && rand() % 100 < 10)
+            {
+                ptr[i] = kmem_cache_alloc(cache);
+                churn++;
+            }
+        }
+        while (churn)
+        {
+            const int i = rand() % FRAG_OBJECTS;
+            if (ptr[i])
+            {
+                kmem_cache_free(cache, ptr[i]);
+                ptr[i] = NULL;
+                churn--;
+            }
+        }
+    }
+    kmem_cache_shrink(cache);
+
+    int live = 0;
+    for (int i = 0; i < FRAG_OBJECTS; i++)
+        live += ptr[i] != NULL;
+    const int slabs = frag_count_slabs(cache->pSlab[HAS_SPACE]) + frag_count_slabs(cache->pSlab[FULL]);
+    const double used = (double)live * objSize / ((double)slabs * cache->layout.slabSize);
+
+    sprintf_s(what, sizeof(what), "Fragmentation, %llu B, free %d%%", (unsigned long long)objSize, freePercent);
+    printf("%-40s %8d slabs %8d live %8.1f%% used\n", what, slabs, live, used * 100);
+
+    for (int i = 0; i < FRAG_OBJECTS; i++)
+        if (ptr[i])
+            kmem_cache_free(cache, ptr[i]);
+    kmem_cache_destroy(cache);
+    free(ptr);
+}
+
+BENCH_START(fragmentation, 8192)
+{
+    frag_run(64, 50);
+    frag_run(64, 90);
+    frag_run(256, 50);
+    frag_run(256, 90);
+}
+BENCH_END
@@ -0,0 +1,47 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// kmalloc with a constant size, whose class folds at compile time, against the same size in a variable
+
+#define KMALLOC_ROUNDS 200
+#define KMALLOC_BATCH 4096
+
+static void *s_objects[KMALLOC_BATCH];
+
+static void kmalloc_class_run(int constant)
+{
+    volatile size_t size = 64;
+    uint64_t allocTicks = 0;
+
+    for (int r = 0; r < KMALLOC_ROUNDS; r++)
+    {
+        const uint64_t start = read_timestamp();
+        if (constant)
+        {
+            for (int i = 0; i < KMALLOC_BATCH; i++)
+                s_objects[i] = kmalloc(64);
+        }
+        else
+        {
+            for (int i = 0; i < KMALLOC_BATCH; i++)
+                s_objects[i] = kmalloc(size);
+        }
+        allocTicks += read_timestamp() - start;
+
+        for (int i = 0; i < KMALLOC_BATCH; i++)
+            kfree(s_objects[i]);
+    }
+
+    bench_report(constant ? "kmalloc, constant 64 B" : "kmalloc, variable 64 B", bench_ns(0, allocTicks),
+                 (uint64_t)KMALLOC_ROUNDS * KMALLOC_BATCH);
+}
+
+BENCH_START(kmalloc_class, 1024)
+{
+    kmalloc_class_run(0);
+    kmalloc_class_run(1);
+    kmalloc_class_run(0);
+    kmalloc_class_run(1);
+}
+BENCH_END
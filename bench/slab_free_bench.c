@@ -0,0 +1,55 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// Latency of slab_free for object sizes that are not powers of two
+
+#define FREE_ROUNDS 20000
+
+static void free_run(size_t objSize)
+{
+    char what[64];
+    size_t l1Offset = 0;
+    kmem_slab_t *slab;
+    void *ptr[BLOCK_SIZE];
+
+    get_slab(objSize, &l1Offset, &slab);
+    const int numObjects = NUMBER_OF_OBJECTS_IN_SLAB(slab);
+    for (int i = 0; i < numObjects; i++)
+        slab_allocate(slab, &ptr[i]);
+
+    // Free in a scattered order so the bitmap updates don't just stream
+    srand(1);
+    for (int i = numObjects - 1; i > 0; i--)
+    {
+        const int r = rand() % (i + 1);
+        void *tmp = ptr[i];
+        ptr[i] = ptr[r];
+        ptr[r] = tmp;
+    }
+
+    uint64_t ticks = 0;
+    for (int round = 0; round < FREE_ROUNDS; round++)
+    {
+        const uint64_t start = read_timestamp();
+        for (int i = 0; i < numObjects; i++)
+            slab_free(slab, ptr[i]);
+        ticks += read_timestamp() - start;
+
+        for (int i = 0; i < numObjects; i++)
+            slab_allocate(slab, &ptr[i]);
+    }
+    delete_slab(slab);
+
+    sprintf_s(what, sizeof(what), "Slab free, %llu B objects", (unsigned long long)objSize);
+    bench_report(what, bench_ns(0, ticks), (uint64_t)FREE_ROUNDS * numObjects);
+}
+
+BENCH_START(slab_free, 1024)
+{
+    free_run(24);
+    free_run(40);
+    free_run(100);
+    free_run(700);
+}
+BENCH_END
@@ -0,0 +1,33 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+
+// Cost of building a fresh slab, the work done on every cache refill
+
+#define REFILL_ITER 200000
+
+static void refill_run(size_t objSize)
+{
+    char what[64];
+    size_t l1Offset = 0;
+    kmem_slab_t *slab;
+
+    const uint64_t start = read_timestamp();
+    for (int i = 0; i < REFILL_ITER; i++)
+    {
+        get_slab(objSize, &l1Offset, &slab);
+        delete_slab(slab);
+    }
+    const double ns = bench_ns(start, read_timestamp());
+
+    sprintf_s(what, sizeof(what), "Slab refill, %llu B objects", (unsigned long long)objSize);
+    bench_report(what, ns, REFILL_ITER);
+}
+
+BENCH_START(slab_refill, 1024)
+{
+    refill_run(8);
+    refill_run(32);
+    refill_run(256);
+}
+BENCH_END
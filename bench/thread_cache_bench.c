@@ -0,0 +1,65 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+#include <windows.h>
+
+// Threads kmalloc and kfree small batches of one class, with and without per thread class lists
+
+#define TC_THREADS 4
+#define TC_BATCH 64
+#define TC_ROUNDS 20000
+#define TC_SIZE 64
+
+typedef struct tc_thread_struct
+{
+    uint64_t ticks;
+} tc_thread_t;
+
+static DWORD WINAPI tc_thread_main(LPVOID arg)
+{
+    tc_thread_t *thread = (tc_thread_t *)arg;
+    void *objects[TC_BATCH];
+
+    const uint64_t start = read_timestamp();
+    for (int r = 0; r < TC_ROUNDS; r++)
+    {
+        for (int i = 0; i < TC_BATCH; i++)
+            objects[i] = kmalloc(TC_SIZE);
+        for (int i = 0; i < TC_BATCH; i++)
+            kfree(objects[i]);
+    }
+    thread->ticks = read_timestamp() - start;
+
+    return 0;
+}
+
+static void tc_run(int threads, int enabled)
+{
+    tc_thread_t thread[TC_THREADS];
+    HANDLE handles[TC_THREADS];
+    char what[64];
+
+    kmem_thread_cache_enable(enabled);
+    for (int t = 0; t < threads; t++)
+        handles[t] = CreateThread(NULL, 0, tc_thread_main, &thread[t], 0, NULL);
+    double ns = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+        ns += bench_ns(0, thread[t].ticks);
+    }
+
+    sprintf_s(what, sizeof(what), "%d threads, thread caches %s", threads, enabled ? "on" : "off");
+    bench_report(what, ns, (uint64_t)threads * TC_ROUNDS * TC_BATCH * 2);
+}
+
+BENCH_START(thread_cache, 4096)
+{
+    for (int threads = 1; threads <= TC_THREADS; threads *= 2)
+    {
+        tc_run(threads, 0);
+        tc_run(threads, 1);
+    }
+}
+BENCH_END
@@ -0,0 +1,50 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_typed.h"
+
+// Alloc and free through a DEFINE_KMEM_CACHE cache against the same type through the generic calls
+
+#define TYPED_ROUNDS 200
+#define TYPED_BATCH 4096
+
+typedef struct typed_bench_struct
+{
+    uint64_t key;
+    uint64_t value[5];
+} typed_bench_t;
+
+DEFINE_KMEM_CACHE(typed_bench, typed_bench_t, 0)
+
+static void typed_run(int typed)
+{
+    static void *objects[TYPED_BATCH];
+    typed_bench_cache_create();
+
+    const uint64_t start = read_timestamp();
+    for (int r = 0; r < TYPED_ROUNDS; r++)
+    {
+        for (int i = 0; i < TYPED_BATCH; i++)
+            objects[i] = typed ? typed_bench_alloc() : kmem_cache_alloc(typed_bench_cachep);
+        for (int i = 0; i < TYPED_BATCH; i++)
+        {
+            if (typed)
+                typed_bench_free(objects[i]);
+            else
+                kmem_cache_free(typed_bench_cachep, objects[i]);
+        }
+    }
+    const uint64_t end = read_timestamp();
+
+    bench_report(typed ? "typed alloc + free, 48 B" : "generic alloc + free, 48 B", bench_ns(start, end),
+                 (uint64_t)TYPED_ROUNDS * TYPED_BATCH);
+    typed_bench_cache_destroy();
+}
+
+BENCH_START(typed_cache, 1024)
+{
+    typed_run(0);
+    typed_run(1);
+    typed_run(0);
+    typed_run(1);
+}
+BENCH_END
@@ -0,0 +1,62 @@
+#include "bench.h"
+#include "buddy/buddy.h"
+#include "slab_impl.h"
+#include <string.h>
+
+// Zeroed allocations from a freshly grown cache. On a zeroed arena frontier slots skip the clear
+
+#define ZALLOC_ARENA_BLOCKS 8192
+#define ZALLOC_BYTES (8 * 1024 * 1024)
+
+enum Zalloc_Mode
+{
+    ZALLOC_MEMSET = 0, // kmem_cache_alloc followed by memset
+    ZALLOC_DIRTY = 1,  // kmem_cache_zalloc, arena not known zero
+    ZALLOC_ZEROED = 2  // kmem_cache_zalloc, arena from kmem_init_zeroed
+};
+
+static void zalloc_run(size_t objSize, enum Zalloc_Mode mode)
+{
+    static const char *Names[] = {"alloc + memset", "zalloc", "zalloc, zeroed arena"};
+    char what[64];
+    const int numObjects = (int)(ZALLOC_BYTES / objSize);
+    // Every page is touched up front so page faults don't hide the clearing cost
+    volatile char *arena = calloc(ZALLOC_ARENA_BLOCKS, BLOCK_SIZE);
+    for (size_t off = 0; off < (size_t)ZALLOC_ARENA_BLOCKS * BLOCK_SIZE; off += BLOCK_SIZE)
+        arena[off] = 0;
+    if (mode == ZALLOC_ZEROED)
+        kmem_init_zeroed((void *)arena, ZALLOC_ARENA_BLOCKS);
+    else
+        kmem_init((void *)arena, ZALLOC_ARENA_BLOCKS);
+    kmem_cache_t *cache = kmem_cache_create("Zalloc", objSize, NULL, NULL);
+
+    const uint64_t start = read_timestamp();
+    for (int i = 0; i < numObjects; i++)
+    {
+        if (mode == ZALLOC_MEMSET)
+            memset(kmem_cache_alloc(cache), 0, objSize);
+        else
+            kmem_cache_zalloc(cache);
+    }
+    const uint64_t end = read_timestamp();
+
+    sprintf_s(what, sizeof(what), "%s, %llu B", Names[mode], (unsigned long long)objSize);
+    bench_report(what, bench_ns(start, end), (uint64_t)numObjects);
+
+    kmem_cache_destroy(cache);
+    buddy_destroy();
+    free((void *)arena);
+}
+
+BENCH_START(zalloc, 1024)
+{
+    const size_t Sizes[] = {64, 256, 1024};
+    for (int s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++)
+    {
+        zalloc_run(Sizes[s], ZALLOC_MEMSET);
+        zalloc_run(Sizes[s], ZALLOC_DIRTY);
+        zalloc_run(Sizes[s], ZALLOC_ZEROED);
+    }
+    kmem_init(_ptr, MEMORY_SIZE);
+}
+BENCH_END
@@ -3,17 +3,35 @@
 
 #include "error_codes.h"
 #include "helper.h"
+#include "kmem_lock.h"
 #include <stdint.h>
 #include <stdlib.h>
 #include <windows.h>
 
 #define BUDDY_BLOCK_SIZE 4096
 
+// Absolute alignment of the first managed block, bigger values let more orders be naturally aligned
+#ifndef BUDDY_REGION_ALIGN
+#define BUDDY_REGION_ALIGN BUDDY_BLOCK_SIZE
+#endif
+
+// One order tag per minimum block, meaningful only on the first block of a buddy block
+#define BUDDY_TAG_FREE 0x80
+#define BUDDY_TAG_HOT 0x40 // In a hot cache, neither allocated nor mergeable
+#define BUDDY_TAG_RUN 0x20 // Allocated piece continuing the exact allocation before it
+#define BUDDY_TAG_NONE 0xFF
+
+// Orders that get a hot cache of recently freed blocks
+#define BUDDY_HOT_ORDERS 4
+
+// Descriptor of a minimum block, free lists link descriptors and never the block memory
 typedef struct buddy_block_struct
 {
     struct buddy_block_struct *prev;
     struct buddy_block_struct *next;
     uint8_t blockid;
+    uint8_t dirty; // Memory was given out and returned, or the arena was not known to be zero
+    uint8_t mark;  // Set by the user of the allocation starting here, buddy_free clears it
 } buddy_block_t;
 
 typedef struct buddy_table_entry_struct
@@ -23,6 +41,23 @@ typedef struct buddy_table_entry_struct
     size_t numByteMap;
 } buddy_table_entry_t;
 
+typedef struct buddy_hot_cache_struct
+{
+    buddy_block_t *block; // Singly linked through next
+    size_t count;
+} buddy_hot_cache_t;
+
+typedef struct buddy_stats_struct
+{
+    uint64_t splits;
+    uint64_t merges;
+    uint64_t hotHits;    // Allocations served by a hot cache
+    uint64_t hotFrees;   // Frees that went to a hot cache
+    uint64_t hotDrained; // Hot blocks given back to the free lists
+    uint64_t trimmed;    // Blocks returned right away by exact allocations
+    uint64_t largeExtents; // Large allocations that spanned several free blocks
+} buddy_stats_t;
+
 typedef struct buddy_allocator_struct
 {
     void *vpStart;
@@ -31,13 +66,38 @@ typedef struct buddy_allocator_struct
     void *vpMemoryStart;
     size_t memorySize;
     buddy_table_entry_t *vpMemoryBlocks;
-    CRITICAL_SECTION CriticalSection;
+    uint8_t *pOrderTags; // Order of the block starting at each minimum block, BUDDY_TAG_FREE when on a free list
+    size_t numOrderTags;
+    buddy_block_t *pDescriptors; // One per minimum block, parallel to pOrderTags
+    buddy_hot_cache_t hot[BUDDY_HOT_ORDERS];
+    size_t hotWatermark; // 0 disables hot caches, frees merge right away
+    buddy_stats_t stats;
+    kmem_lock_t CriticalSection;
 } buddy_allocator_t;
 
 CRESULT buddy_init(void *vpSpace, size_t size);
 CRESULT buddy_destroy();
 CRESULT buddy_alloc(size_t size, void **result);
-CRESULT buddy_free(void *ptr, size_t size);
+// Takes only the blocks needed, the rest of the power of two block goes back to the free lists
+CRESULT buddy_alloc_exact(size_t size, void **result);
+// Result is aligned to align in absolute address space, blocks around it go back to the free lists
+CRESULT buddy_alloc_aligned(size_t size, size_t align, void **result);
+// Exact allocation, falls back to a best fit run of adjacent free blocks of any orders
+CRESULT buddy_alloc_large(size_t size, void **result);
+// Grows an allocation in place over the free blocks that follow it
+CRESULT buddy_extend(void *ptr, size_t size);
+CRESULT buddy_free(void *ptr);
+size_t buddy_usable_size(const void *ptr);
+void buddy_assume_zeroed(); // Arena memory is zero, must be called before the first allocation
+bool buddy_is_zeroed(const void *ptr, size_t size); // Range is still zero since buddy_assume_zeroed
+void *buddy_block_start(const void *ptr); // Allocation containing ptr, NULL if it is free
+CRESULT buddy_set_mark(void *ptr, uint8_t mark); // Tags the allocation ptr starts for its user
+uint8_t buddy_get_mark(const void *ptr);         // Tag of the allocation ptr starts, 0 if ptr starts none
+
+// Frees of small orders are kept unmerged until more than watermark blocks pile up
+CRESULT buddy_hot_cache_set(size_t watermark);
+void buddy_hot_cache_drain();
+CRESULT buddy_get_stats(buddy_stats_t *result);
 
 void buddy_print_memory_offsets();
 void buddy_print_bitmap();
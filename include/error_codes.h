@@ -13,7 +13,8 @@ typedef enum Result_Code_Enum
     SLAB_FULL = 64,
     SLAB_DEALLOC_NOT_VALID_ADDRES = 128,
     SLAB_DELETE_FAIL = 256,
-    FAIL = 512
+    FAIL = 512,
+    BUDDY_FREE_NOT_VALID_ADDRES = 1024
 } CRESULT;
 
 void printCode(int code);
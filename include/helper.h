@@ -9,6 +9,8 @@
 #define LOGING
 //#define LOGING_BUDDY
 #define LOGING_SLAB
+//#define TRACING
+//#define LOCK_STATS
 
 #ifdef LOGING
 
@@ -38,16 +40,26 @@ static uint64_t __inline clz(uint64_t value)
 }
 
 #define FLS(num) clz(num)
+#define FLS64(num) clz(num)
+#define POPCOUNT64(num) __popcnt64(num)
 #else
 #define FLS(num) (num ? sizeof(int) * CHAR_BIT - __builtin_clz(num) : 0)
+#define FLS64(num) (num ? 64 - __builtin_clzll(num) : 0)
+#define POPCOUNT64(num) __builtin_popcountll(num)
 #endif
 
 // Find first >= POW_TWO
 #define BEST_FIT_BLOCKID(num) (num == 0 ? 0 : FLS(num - 1))
 
 #define POWER_OF_TWO(num) ((num & (num - 1)) == 0)
+#define ALIGN_UP(num, align) (((num) + (align)-1) & ~((size_t)(align)-1))
 #define ROUND_TO_POWER_OF_TWO(num) (1 << (BEST_FIT_BLOCKID(num)))
 
+// Division by a constant as multiply and shift, exact while num * div < 2^63
+#define RECIPROCAL_SHIFT(div) (32 + BEST_FIT_BLOCKID(div))
+#define RECIPROCAL_VALUE(div) ((((uint64_t)1 << RECIPROCAL_SHIFT(div)) + (div)-1) / (div))
+#define RECIPROCAL_DIVIDE(num, reciprocal, shift) (((uint64_t)(num) * (reciprocal)) >> (shift))
+
 //******************************************************************//
 // ASSERTION *******************************************************//
 #include <assert.h>
@@ -62,4 +74,29 @@ typedef char bool;
 #define true 1
 #define false 0
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+//******************************************************************//
+// TIMING *******************************************************//
+#include <stdint.h>
+#include <windows.h>
+
+static inline uint64_t read_timestamp()
+{
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)counter.QuadPart;
+}
+
+static inline uint64_t read_timestamp_frequency()
+{
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)frequency.QuadPart;
+}
+
 #endif // __HELPER_H
@@ -0,0 +1,46 @@
+#ifndef __KMEM_LOCK_H
+#define __KMEM_LOCK_H
+
+#include "helper.h"
+#include "slab.h"
+#include <windows.h>
+
+//******************************************************************//
+// INSTRUMENTED LOCK *******************************************************//
+
+#ifdef LOCK_STATS
+
+typedef struct kmem_lock_struct
+{
+    CRITICAL_SECTION CriticalSection;
+    int depth;
+    uint64_t acquiredAt;
+    kmem_lock_stats_t stats;
+} kmem_lock_t;
+
+BOOL kmem_lock_init(kmem_lock_t *lock, DWORD spinCount);
+void kmem_lock_enter(kmem_lock_t *lock);
+BOOL kmem_lock_try_enter(kmem_lock_t *lock);
+void kmem_lock_leave(kmem_lock_t *lock);
+
+#define LOCK_INIT(lock, spinCount) kmem_lock_init(lock, spinCount)
+#define LOCK_ENTER(lock) kmem_lock_enter(lock)
+#define LOCK_TRY_ENTER(lock) kmem_lock_try_enter(lock)
+#define LOCK_LEAVE(lock) kmem_lock_leave(lock)
+#define LOCK_DELETE(lock) DeleteCriticalSection(&(lock)->CriticalSection)
+#define LOCK_STATS_GET(lock, result) ((*(result) = (lock)->stats), OK)
+
+#else
+
+typedef CRITICAL_SECTION kmem_lock_t;
+
+#define LOCK_INIT(lock, spinCount) InitializeCriticalSectionAndSpinCount(lock, spinCount)
+#define LOCK_ENTER(lock) EnterCriticalSection(lock)
+#define LOCK_TRY_ENTER(lock) TryEnterCriticalSection(lock)
+#define LOCK_LEAVE(lock) LeaveCriticalSection(lock)
+#define LOCK_DELETE(lock) DeleteCriticalSection(lock)
+#define LOCK_STATS_GET(lock, result) FAIL
+
+#endif // LOCK_STATS
+
+#endif // __KMEM_LOCK_H
@@ -1,24 +1,138 @@
 #ifndef __SLAB_H
 #define __SLAB_H
 
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct kmem_cache_struct kmem_cache_t;
 
+// Lock profiling counters, times are in read_timestamp() ticks. Filled only with LOCK_STATS
+typedef struct kmem_lock_stats_struct
+{
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t waitTotal;
+    uint64_t waitMax;
+    uint64_t holdTotal;
+    uint64_t holdMax;
+} kmem_lock_stats_t;
+
 #define BLOCK_SIZE (4096)
 #define CACHE_L1_LINE_SIZE (64)
+#define CACHE_L2_WAY_SIZE (64 * 1024)
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // Slabs this big are aligned to it so they can be backed by a huge page
+
+// Frees memory held outside the caches when the buddy allocator runs dry, returns pages freed
+typedef size_t (*kmem_shrinker_t)(void *context, size_t pagesWanted);
+
+typedef struct kmem_reclaim_stats_struct
+{
+    uint64_t passes;         // Slab allocations that found the buddy allocator empty
+    uint64_t pagesRecovered; // Pages freed by shrinking caches and calling shrinkers
+    uint64_t failures;       // Passes after which the allocation still failed
+    uint64_t backgroundPasses; // Passes of the background reclaimer
+    uint64_t backgroundSlabs;  // Idle EMPTY slabs it released
+} kmem_reclaim_stats_t;
+
+#define KMEM_MAX_SHRINKERS 8
+
+// Copies object from to to and repoints its users, returns 0 if the object can't move now.
+// kmem_cache_defrag first moves the active and partial slabs of every CPU to the cache wide lists,
+// so each CPU takes a new active slab on its next allocation
+typedef int (*kmem_move_t)(void *from, void *to);
+
+// kmalloc classes: 8, 16, 24, 32 and then powers of two up to 1 << BUFFER_SIZE_MAX
+#define BUFFER_SIZE_MAX 17
+#define BUFFER_SIZE_MIN 5
+#define BUFFER_SMALL_STEP_POW_2 3
+#define BUFFER_SMALL_NUM ((1 << BUFFER_SIZE_MIN >> BUFFER_SMALL_STEP_POW_2) - 1)
+#define BUFFER_ENTRY_NUM (BUFFER_SMALL_NUM + BUFFER_SIZE_MAX - BUFFER_SIZE_MIN + 1)
+
+// Index of the highest set bit plus one, 0 for 0. Folds to a constant for constant num
+static inline int kmalloc_fls(size_t num)
+{
+#if defined(__GNUC__)
+    return num ? (int)(sizeof(unsigned long long) * 8 - __builtin_clzll(num)) : 0;
+#else
+    int sol = 0;
+    for (; num; num >>= 1)
+        sol++;
+    return sol;
+#endif
+}
+
+static inline int kmalloc_index(size_t size)
+{
+    if (!size || size > (1 << BUFFER_SIZE_MAX))
+        return -1;
+    if (size <= (1 << BUFFER_SIZE_MIN))
+        return (int)((size - 1) >> BUFFER_SMALL_STEP_POW_2);
+    return kmalloc_fls(size - 1) - BUFFER_SIZE_MIN + BUFFER_SMALL_NUM;
+}
+
+static inline size_t kmalloc_class_size(int index)
+{
+    if (index < BUFFER_SMALL_NUM)
+        return (size_t)(index + 1) << BUFFER_SMALL_STEP_POW_2;
+    return (size_t)1 << (index - BUFFER_SMALL_NUM + BUFFER_SIZE_MIN);
+}
+
+#define SLAB_HWCACHE_ALIGN 0x1 // Align objects to L1 cache line, small objects share lines
+#define SLAB_L2_COLOR 0x2      // Colors follow slab address, also spreads slabs that alias in L2 sets
+#define SLAB_NO_COLOR 0x4      // All slabs start objects at the same offset
 
 void kmem_init(void *space, int block_num);
+void kmem_init_zeroed(void *space, int block_num); // Space is known zero, like fresh VirtualAlloc pages
 
 kmem_cache_t *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *),
                                 void (*dtor)(void *));  // Allocate cache
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size, size_t align, unsigned flags,
+                                        void (*ctor)(void *), void (*dtor)(void *)); // Allocate cache, align is 0 or power of two, flags SLAB_*
 int kmem_cache_shrink(kmem_cache_t *cachep);            // Shrink cache
+int kmem_cache_defrag(kmem_cache_t *cachep, kmem_move_t move); // Empty sparsest slabs into fuller ones, returns slabs freed
 void *kmem_cache_alloc(kmem_cache_t *cachep);           // Allocate one object from cache
+void *kmem_cache_zalloc(kmem_cache_t *cachep);          // Allocate one zeroed object from cache
+void *kmem_cache_alloc_hint(kmem_cache_t *cachep, const void *near); // Prefer near's slab, then its 2 MiB region
 void kmem_cache_free(kmem_cache_t *cachep, void *objp); // Deallocate one object from cache
-void *kmalloc(size_t size);                             // Alloacate one small memory buffer
-void kfree(const void *objp);                           // Deallocate one small memory buffer
+void *kmalloc_generic(size_t size);                     // Alloacate one memory buffer, large ones come from buddy
+void *kmalloc_class(int index);                         // Allocate one buffer of size class index
+void *kzalloc(size_t size);                             // Allocate one zeroed memory buffer
+void kfree(const void *objp);                           // Deallocate one memory buffer
+size_t ksize(const void *objp);                         // Usable size of a kmalloc buffer
+void *krealloc(const void *objp, size_t size);          // Same buffer if size fits, NULL keeps objp valid
 void kmem_cache_destroy(kmem_cache_t *cachep);          // Deallocate cache
 void kmem_cache_info(kmem_cache_t *cachep);             // Print cache info
 int kmem_cache_error(kmem_cache_t *cachep);             // Print error message
 
+int kmem_cache_lock_stats(kmem_cache_t *cachep, kmem_lock_stats_t *stats); // Lock stats of one cache
+int kmem_lock_stats(const char *name, kmem_lock_stats_t *stats); // Lock stats by cache name, "buddy" or "size-N"
+void kmem_lock_stats_print();                                    // Print lock stats of all caches
+
+// Constant sizes resolve their class at compile time and skip the size checks
+static inline void *kmalloc(size_t size)
+{
+#if defined(__GNUC__)
+    if (__builtin_constant_p(size) && kmalloc_index(size) >= 0)
+        return kmalloc_class(kmalloc_index(size));
+#endif
+    return kmalloc_generic(size);
+}
+
+// kmalloc classes keep per thread lists, on by default after kmem_init. Leftovers go back to the classes
+// when a thread exits, and when memory runs out other threads drain theirs on their next kmalloc or
+// kfree. Disabling flushes only the calling thread, other threads keep theirs until exit.
+// kfree only records the pointer in the thread, a batch of them is checked and freed under the class
+// locks, so interior pointers, buffers of other caches and second frees are refused in every build
+int kmem_thread_cache_enable(int enabled); // Returns previous setting
+void kmem_thread_cache_flush();            // Return calling thread's cached buffers to their classes
+
+int kmem_register_shrinker(kmem_shrinker_t shrink, void *context);   // Called on buddy exhaustion after caches, no locks held
+int kmem_unregister_shrinker(kmem_shrinker_t shrink, void *context); // Remove shrinker registered with same context
+void kmem_reclaim_stats(kmem_reclaim_stats_t *stats);                // Reclaim counters since kmem_init
+
+// Background thread that every periodMs releases EMPTY slabs idle for idlePasses passes and coalesces
+// buddy hot caches. A cache lock is held for at most batch slabs. While it runs kfree doesn't shrink.
+int kmem_reclaimer_start(unsigned periodMs, unsigned idlePasses, unsigned batch);
+void kmem_reclaimer_stop(); // Waits for the thread, must be called before kmem_init or freeing the arena
+
 #endif // __SLAB_H
\ No newline at end of file
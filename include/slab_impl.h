@@ -3,6 +3,7 @@
 
 #include "error_codes.h"
 #include "helper.h"
+#include "kmem_lock.h"
 #include <windows.h>
 
 #if defined(LOGING) && defined(LOGING_SLAB)
@@ -15,8 +16,8 @@
 
 typedef void (*function)(void *);
 
-typedef uint8_t BitMapEntry;
-#define BITMAP_NUM_BITS_ENTRY_POW_2 3
+typedef uint64_t BitMapEntry;
+#define BITMAP_NUM_BITS_ENTRY_POW_2 6
 #define NAME_MAX_LEN 32
 typedef struct kmem_slab_struct
 {
@@ -25,14 +26,103 @@ typedef struct kmem_slab_struct
     size_t objectSize;
     size_t slabSize;
     size_t takenSlots;
+    size_t capacity;     // Objects that fit after header, bitmap and color
+    uint64_t reciprocal; // Object index is offset * reciprocal >> reciprocalShift
     BitMapEntry *pBitmap;
     int numBitMapEntry;
-    size_t cacheMoved;
+    int frontier; // Slots from here on were never allocated and are not tracked in bitmap
     void *memStart;
+    struct kmem_cache_struct *cache; // Owner, set once before the slab is marked
+    uint32_t emptySince; // Reclaimer pass in which the slab went EMPTY
+    uint8_t list;        // Slab_Type or Slab_Cpu_Type
+    uint8_t cpu;         // Owning CPU, valid for CPU_ACTIVE and CPU_PARTIAL
+    uint8_t reciprocalShift;
+    uint8_t bucket; // Occupancy bucket, valid for HAS_SPACE
+    uint8_t zeroed; // Slab memory was never used, so slots from frontier on are zero
 } kmem_slab_t;
 
-#define NUMBER_OF_OBJECTS_IN_SLAB(slab)                                                                                \
-    ((slab->slabSize - sizeof(kmem_slab_t) - slab->numBitMapEntry * sizeof(BitMapEntry)) / slab->objectSize)
+// Buddy mark of slab allocations. Only a marked allocation starts with a kmem_slab_t
+#define KMEM_SLAB_MARK 1
+
+#define NUMBER_OF_OBJECTS_IN_SLAB(slab) ((slab)->capacity)
+#define SLAB_FREE_SLOTS(slab) ((slab)->capacity - (slab)->takenSlots)
+
+// HAS_SPACE list is kept grouped by occupancy, fullest bucket first, so refills drain nearly full slabs
+#define KMEM_PARTIAL_BUCKETS 8
+#define SLAB_OCCUPANCY_BUCKET(slab) ((uint8_t)((slab)->takenSlots * KMEM_PARTIAL_BUCKETS / (slab)->capacity))
+
+#define SLAB_BITMAP_USED_ENTRIES(slab)                                                                                 \
+    ((slab->frontier + (1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1) >> BITMAP_NUM_BITS_ENTRY_POW_2)
+
+static inline size_t slab_size_for_object(size_t objectSize, size_t align)
+{
+    // Header, at least one bitmap entry and alignment padding must fit next to the object
+    const size_t minSize = objectSize + sizeof(kmem_slab_t) + sizeof(BitMapEntry) + align - 1;
+    size_t sizeOfSlab = BLOCK_SIZE;
+    if (minSize > sizeOfSlab)
+    {
+        sizeOfSlab = (minSize - 1) / BLOCK_SIZE + 1;
+        sizeOfSlab = (1 << BEST_FIT_BLOCKID(sizeOfSlab)) * BLOCK_SIZE;
+    }
+    return sizeOfSlab;
+}
+
+// ptr starts a slot that was handed out and isn't free in the bitmap. Objects parked in thread
+// caches still count as allocated here
+static inline bool slab_slot_allocated(const kmem_slab_t *slab, const void *ptr)
+{
+    if (ptr < slab->memStart || (size_t)ptr >= (size_t)slab + slab->slabSize)
+        return false;
+
+    const size_t offset = (size_t)ptr - (size_t)slab->memStart;
+    const size_t id = RECIPROCAL_DIVIDE(offset, slab->reciprocal, slab->reciprocalShift);
+    if (id * slab->objectSize != offset || id >= (size_t)slab->frontier)
+        return false;
+    return !(slab->pBitmap[id >> BITMAP_NUM_BITS_ENTRY_POW_2] &
+             ((BitMapEntry)1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1))));
+}
+
+// Takes a never used slot at the frontier first, then the lowest freed one. objectSize is a
+// parameter so callers that know it at compile time get the multiply folded
+static inline CRESULT slab_allocate_sized(kmem_slab_t *slab, size_t objectSize, void **result)
+{
+    int objId = -1;
+    if ((size_t)slab->frontier < NUMBER_OF_OBJECTS_IN_SLAB(slab))
+    {
+        // Never used slot, touches only the object itself and first time its bitmap entry
+        objId = slab->frontier++;
+        if (!(objId & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1)))
+        {
+            slab->pBitmap[objId >> BITMAP_NUM_BITS_ENTRY_POW_2] = 0;
+        }
+        *result = (void *)((size_t)slab->memStart + objectSize * objId);
+        slab->takenSlots++;
+        return OK;
+    }
+
+    const int usedEntries = SLAB_BITMAP_USED_ENTRIES(slab);
+    for (int i = 0; i < usedEntries; i++)
+    {
+        if (slab->pBitmap[i])
+        {
+            const int off = FLS64(slab->pBitmap[i]) - 1;
+            slab->pBitmap[i] &= ~((BitMapEntry)1 << off);
+            objId = (i << BITMAP_NUM_BITS_ENTRY_POW_2) + off;
+            break;
+        }
+    }
+
+    if (objId == -1)
+    {
+        *result = NULL;
+        return SLAB_FULL;
+    }
+
+    *result = (void *)((size_t)slab->memStart + objectSize * objId);
+    slab->takenSlots++;
+
+    return OK;
+}
 
 enum Slab_Type
 {
@@ -42,33 +132,104 @@ enum Slab_Type
     NUM_TYPES = 3
 };
 
+// Slabs owned by one CPU are kept off the node wide pSlab lists
+enum Slab_Cpu_Type
+{
+    CPU_ACTIVE = NUM_TYPES,
+    CPU_PARTIAL = NUM_TYPES + 1
+};
+
+#ifndef KMEM_MAX_CPUS
+#define KMEM_MAX_CPUS 16
+#endif
+#define KMEM_CPU_PARTIAL_MAX 4
+
+static inline int kmem_current_cpu()
+{
+    return GetCurrentProcessorNumber() % KMEM_MAX_CPUS;
+}
+// Per thread kmalloc class lists, see kmem_thread_cache.c
+#define KMEM_THREAD_BATCH_BYTES (4 * 1024) // Refill step of a list, at most KMEM_THREAD_BATCH_MAX objects
+#define KMEM_THREAD_BATCH_MAX 32
+#define KMEM_THREAD_LIMIT_BYTES (32 * 1024) // Most a refill grows to, at least one batch
+#define KMEM_THREAD_FREE_MAX 64             // kfree pointers a thread records before they are checked and freed
+
+#define KMEM_HINT_SCAN 32 // HAS_SPACE slabs searched for one in the region of an allocation hint
+
+typedef struct kmem_cpu_slab_struct
+{
+    kmem_slab_t *pActive;  // Slab this CPU allocates from
+    kmem_slab_t *pPartial; // Slabs of this CPU that got space back after being FULL
+    int numPartial;
+} kmem_cpu_slab_t;
+
+enum Slab_Color
+{
+    SLAB_COLOR_NONE = 0,
+    SLAB_COLOR_L1 = 1, // Colors cycle per slab, spreads L1 sets
+    SLAB_COLOR_L2 = 2  // Colors follow slab address, also spreads slabs that alias in L2
+};
+
+// Slab geometry and coloring, computed once per cache
+typedef struct kmem_slab_layout_struct
+{
+    size_t objectSize; // Padded to align
+    size_t align;
+    size_t slabSize;
+    size_t colorStride;
+    size_t colorCount;
+    size_t colorNext;
+    enum Slab_Color colorMode;
+    uint64_t reciprocal; // RECIPROCAL_VALUE(objectSize)
+    uint8_t reciprocalShift;
+} kmem_slab_layout_t;
+
 struct kmem_cache_struct
 {
-    CRITICAL_SECTION CriticalSection;
+    kmem_lock_t CriticalSection;
+    struct kmem_cache_struct *next; // Chain of all caches, guarded by s_cacheHead lock
+    struct kmem_cache_struct *prev;
     size_t objectSize;
     function constructor;
     function destructor;
     CRESULT errorFlags;
     char name[NAME_MAX_LEN];
-    size_t l1CacheFiller;
+    kmem_slab_layout_t layout;
+    uint64_t lastUsed;    // Stamp of last refill, reclaim shrinks least recently used caches first
+    uint64_t reclaimPass; // Last reclaim pass that visited this cache
     kmem_slab_t *pSlab[NUM_TYPES];
+    kmem_slab_t *pEmptyTail; // Longest EMPTY slab, EMPTY list is ordered newest first
+    kmem_slab_t *pPartialBucket[KMEM_PARTIAL_BUCKETS]; // First HAS_SPACE slab of each occupancy bucket
+    kmem_slab_t *pPartialTail;                         // Emptiest HAS_SPACE slab
+    kmem_cpu_slab_t cpuSlab[KMEM_MAX_CPUS];
 };
 
-typedef struct kmem_buffer_struct
-{
-    size_t size;
-    CRITICAL_SECTION CriticalSection;
-    size_t l1CacheFiller;
-    kmem_slab_t *pSlab[NUM_TYPES];
-} kmem_buffer_t;
+// kmalloc size classes are regular caches named "size-N"
+typedef struct kmem_cache_struct kmem_buffer_t;
 
+size_t slab_bitmap_entries(size_t slabSize, size_t objectSize);
+CRESULT slab_layout_init(kmem_slab_layout_t *layout, size_t objectSize, size_t align, enum Slab_Color colorMode);
+CRESULT get_slab_layout(kmem_slab_layout_t *layout, kmem_slab_t **result);
 CRESULT get_slab(size_t objectSize, size_t *l1CacheOffset, kmem_slab_t **result);
 CRESULT delete_slab(kmem_slab_t *slab);
 CRESULT slab_allocate(kmem_slab_t *slab, void **result);
 CRESULT slab_free(kmem_slab_t *slab, const void *ptr);
+void *slab_next_object(kmem_slab_t *slab, int *id);
 CRESULT slab_list_insert(kmem_slab_t **head, kmem_slab_t *slab);
+CRESULT slab_list_insert_after(kmem_slab_t **head, kmem_slab_t *prev, kmem_slab_t *slab);
 CRESULT slab_list_delete(kmem_slab_t **head, kmem_slab_t *slab);
 CRESULT slab_find_slab_with_obj(kmem_slab_t *head, const void *ptr, kmem_slab_t **result);
+void kmem_slab_full(kmem_cache_t *cache, kmem_slab_t *slab, int cpu); // CPU active slab ran out of slots
+void kmem_slab_freed(kmem_cache_t *cache, kmem_slab_t *slab);         // Slab off CPU active got a slot back
+kmem_slab_t *kmem_slab_lookup(const void *objp, kmem_cache_t **owner); // Slab holding objp, NULL if none
+
+int kmem_buffer_alloc_bulk(int index, int count, void **head);
+void kmem_buffer_free_bulk(int index, void *head);
+void kmem_buffer_free_checked(const void *const *ptrs, int count); // kfree of at most KMEM_THREAD_FREE_MAX
+void kmem_thread_cache_init();                   // New arena, caches of all threads are dropped
+void *kmem_thread_alloc(int index);              // NULL when thread caches are off or the class is empty
+bool kmem_thread_free(const void *objp);         // false when thread caches are off, objp is not read
+void kmem_thread_cache_reclaim();                // Drain calling thread now, other threads on their next use
 
 #include "slab.h"
 
@@ -0,0 +1,111 @@
+#ifndef __SLAB_TYPED_H
+#define __SLAB_TYPED_H
+
+#include "slab_impl.h"
+
+// Caches whose object type is known where they are used. DEFINE_KMEM_CACHE emits alloc and free
+// with the object size as a constant, so slot address and index math fold into shifts and multiplies
+// and the bitmap is found at its fixed offset after the slab header. Capacity depends on the slab's
+// color and the frontier on its use, both are still read from the slab.
+//
+//     DEFINE_KMEM_CACHE(inode, struct inode, 64)
+//     inode_cache_create();
+//     struct inode *p = inode_alloc();
+//     inode_free(p);
+//
+// Typed caches have no constructor or destructor. Objects may also be freed with kmem_cache_free.
+
+#define KMEM_TYPED_ALIGN(align) ((align) ? (size_t)(align) : (size_t)1)
+#define KMEM_TYPED_OBJECT_SIZE(type, align) ALIGN_UP(sizeof(type), KMEM_TYPED_ALIGN(align))
+#define KMEM_TYPED_SLAB_SIZE(type, align)                                                                              \
+    slab_size_for_object(KMEM_TYPED_OBJECT_SIZE(type, align), KMEM_TYPED_ALIGN(align))
+
+// Bitmap starts right after the header in every slab, see get_slab_init_bitmap
+#define KMEM_TYPED_BITMAP(slab) ((BitMapEntry *)((kmem_slab_t *)(slab) + 1))
+
+static inline void *kmem_typed_alloc(kmem_cache_t *cachep, size_t objectSize)
+{
+    void *result;
+    if (!cachep)
+        return NULL;
+
+    LOCK_ENTER(&cachep->CriticalSection);
+    const int cpu = kmem_current_cpu();
+    kmem_slab_t *slab = cachep->cpuSlab[cpu].pActive;
+    if (slab && slab_allocate_sized(slab, objectSize, &result) == OK)
+    {
+        if (!SLAB_FREE_SLOTS(slab))
+        {
+            kmem_slab_full(cachep, slab, cpu);
+        }
+        LOCK_LEAVE(&cachep->CriticalSection);
+        return result;
+    }
+    LOCK_LEAVE(&cachep->CriticalSection);
+
+    // No active slab on this CPU, refill goes through the generic path
+    return kmem_cache_alloc(cachep);
+}
+
+// Same checks as slab_free, a refused free leaves the slab untouched and sets errorFlags. Slab and
+// owner come from buddy before any slab field is read, the cache lock keeps a slab of cachep alive
+static inline void kmem_typed_free(kmem_cache_t *cachep, void *objp, size_t objectSize)
+{
+    if (!cachep || !objp)
+        return;
+
+    LOCK_ENTER(&cachep->CriticalSection);
+    kmem_cache_t *owner;
+    kmem_slab_t *slab = kmem_slab_lookup(objp, &owner);
+    if (!slab || owner != cachep || objp < slab->memStart)
+    {
+        cachep->errorFlags = SLAB_DEALLOC_OBJECT_NOT_IN_SLAB;
+        LOCK_LEAVE(&cachep->CriticalSection);
+        return;
+    }
+
+    const size_t offset = (size_t)objp - (size_t)slab->memStart;
+    const size_t id = offset / objectSize;
+    BitMapEntry *entry = &KMEM_TYPED_BITMAP(slab)[id >> BITMAP_NUM_BITS_ENTRY_POW_2];
+    const BitMapEntry bit = (BitMapEntry)1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1));
+    if (id * objectSize != offset || id >= (size_t)slab->frontier || (*entry & bit))
+    {
+        cachep->errorFlags = SLAB_DEALLOC_NOT_VALID_ADDRES;
+    }
+    else
+    {
+        *entry |= bit;
+        slab->takenSlots--;
+        cachep->errorFlags = OK;
+        if (slab->list != CPU_ACTIVE)
+            kmem_slab_freed(cachep, slab);
+    }
+    LOCK_LEAVE(&cachep->CriticalSection);
+}
+
+#define DEFINE_KMEM_CACHE(name, type, align)                                                                           \
+    static kmem_cache_t *name##_cachep;                                                                                \
+                                                                                                                       \
+    static inline kmem_cache_t *name##_cache_create()                                                                  \
+    {                                                                                                                  \
+        name##_cachep = kmem_cache_create_aligned(#name, sizeof(type), (align), 0, NULL, NULL);                        \
+        return name##_cachep;                                                                                          \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_cache_destroy()                                                                          \
+    {                                                                                                                  \
+        kmem_cache_destroy(name##_cachep);                                                                             \
+        name##_cachep = NULL;                                                                                          \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline type *name##_alloc()                                                                                 \
+    {                                                                                                                  \
+        return (type *)kmem_typed_alloc(name##_cachep, KMEM_TYPED_OBJECT_SIZE(type, align));                           \
+    }                                                                                                                  \
+                                                                                                                       \
+    static inline void name##_free(type *objp)                                                                         \
+    {                                                                                                                  \
+        kmem_typed_free(name##_cachep, objp, KMEM_TYPED_OBJECT_SIZE(type, align));                                     \
+    }
+
+#endif // __SLAB_TYPED_H
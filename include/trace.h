@@ -0,0 +1,76 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include "error_codes.h"
+#include "helper.h"
+#include <stdint.h>
+#include <stdio.h>
+
+//******************************************************************//
+// TRACE EVENTS *******************************************************//
+
+#define TRACE_EVENT_LIST(X)                                                                                            \
+    X(SLAB_GROW)                                                                                                       \
+    X(SLAB_SHRINK)                                                                                                     \
+    X(BUDDY_SPLIT)                                                                                                     \
+    X(BUDDY_MERGE)                                                                                                     \
+    X(CACHE_CREATE)                                                                                                    \
+    X(CACHE_DESTROY)
+
+#define TRACE_EVENT_ENUM(name) TRACE_##name,
+enum Trace_Event
+{
+    TRACE_EVENT_LIST(TRACE_EVENT_ENUM) TRACE_NUM_EVENTS
+};
+#undef TRACE_EVENT_ENUM
+
+// Fixed size binary record, written as is into the ring and the dump file
+typedef struct trace_record_struct
+{
+    uint64_t timestamp;
+    uint32_t threadId;
+    uint16_t event;
+    uint16_t reserved;
+    uint64_t arg0;
+    uint64_t arg1;
+} trace_record_t;
+
+#define TRACE_FILE_MAGIC 0x4352544B // "KTRC"
+#define TRACE_FILE_VERSION 1
+
+typedef struct trace_file_header_struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t reserved;
+    uint64_t timestampFrequency;
+    uint64_t numRecords;
+} trace_file_header_t;
+
+//******************************************************************//
+// TRACE SINK *******************************************************//
+
+// Records per thread ring, must be power of two
+#define TRACE_RING_SIZE_POW_2 12
+#define TRACE_RING_SIZE (1 << TRACE_RING_SIZE_POW_2)
+
+#ifdef TRACING
+
+// Producer side, never blocks. Record is dropped if thread ring is full
+void trace_emit(uint16_t event, uint64_t arg0, uint64_t arg1);
+
+#define TRACE(event, arg0, arg1) trace_emit(TRACE_##event, (uint64_t)(arg0), (uint64_t)(arg1))
+
+#else
+
+#define TRACE(event, arg0, arg1) ((void)0)
+
+#endif // TRACING
+
+// Consumer side, single consumer. Drains rings of all threads that ever traced
+size_t trace_drain(trace_record_t *out, size_t maxRecords);
+CRESULT trace_dump(FILE *file);
+size_t trace_dropped();
+
+#endif // __TRACE_H
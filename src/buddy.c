@@ -1,8 +1,10 @@
 #include "buddy/buddy.h"
 #include "error_codes.h"
 #include "helper.h"
+#include "trace.h"
 
 #include <assert.h>
+#include <string.h>
 
 #define TOTAL_MEMORY_BLOCKID(id) ((1 << id) * ROUND_TO_POWER_OF_TWO(BUDDY_BLOCK_SIZE))
 
@@ -17,45 +19,64 @@
 
 #define BUDDY_BITMAP_MIN_BLOCKID 0
 
-#define BIT_ID_ADR(addr, blockid)                                                                                      \
-    (((size_t)addr - (size_t)s_pBuddyHead->vpMemoryStart) / BLOCK_SIZE_POW_TWO >> blockid + 4)
-#define BIT_ID_OFF(addr, blockid)                                                                                      \
-    (1 << ((((size_t)addr - (size_t)s_pBuddyHead->vpMemoryStart) / BLOCK_SIZE_POW_TWO >> blockid + 1) & 0x7))
+#define BIT_ID_ADR(index, blockid) ((index) >> blockid + 4)
+#define BIT_ID_OFF(index, blockid) (1 << (((index) >> blockid + 1) & 0x7))
 
 #define YOUNG_BROTHER(x, y) (x < y ? x : y)
 #define OLD_BROTHER(x, y) (x > y ? x : y)
 
 buddy_allocator_t *s_pBuddyHead = NULL;
 
-static inline void setBitMapBit(void *addr, uint8_t blockId, uint8_t value)
+// Blocks are described by pDescriptors[index], the memory of a free block is never written
+static inline size_t getBlockIndex(const buddy_block_t *pBlock)
 {
-    ASSERT(addr >= s_pBuddyHead->vpMemoryStart);
+    return (size_t)(pBlock - s_pBuddyHead->pDescriptors);
+}
+
+static inline void *getBlockAddress(const buddy_block_t *pBlock)
+{
+    return (void *)((size_t)s_pBuddyHead->vpMemoryStart + getBlockIndex(pBlock) * BLOCK_SIZE_POW_TWO);
+}
+
+static inline buddy_block_t *getDescriptor(const void *addr)
+{
+    return &s_pBuddyHead->pDescriptors[((size_t)addr - (size_t)s_pBuddyHead->vpMemoryStart) / BLOCK_SIZE_POW_TWO];
+}
+
+static inline void setBitMapBit(buddy_block_t *pBlock, uint8_t blockId, uint8_t value)
+{
+    ASSERT(getBlockIndex(pBlock) < s_pBuddyHead->numOrderTags);
     if (s_pBuddyHead->vpMemoryBlocks[blockId].numByteMap)
     {
-        const size_t indexAdr = BIT_ID_ADR(addr, blockId);
-        const uint8_t bitOff = BIT_ID_OFF(addr, blockId);
+        const size_t indexAdr = BIT_ID_ADR(getBlockIndex(pBlock), blockId);
+        const uint8_t bitOff = BIT_ID_OFF(getBlockIndex(pBlock), blockId);
         const uint8_t byteMap = (value ? s_pBuddyHead->vpMemoryBlocks[blockId].bitmap[indexAdr] | bitOff
                                        : s_pBuddyHead->vpMemoryBlocks[blockId].bitmap[indexAdr] & ~bitOff);
-        s_pBuddyHead->vpMemoryBlocks[blockId].bitmap[BIT_ID_ADR(addr, blockId)] = byteMap;
+        s_pBuddyHead->vpMemoryBlocks[blockId].bitmap[indexAdr] = byteMap;
     }
 }
 
-static inline bool getBitMapBit(void *addr, uint8_t blockId)
+static inline bool getBitMapBit(buddy_block_t *pBlock, uint8_t blockId)
 {
-    ASSERT(addr);
+    ASSERT(pBlock);
     if (s_pBuddyHead->vpMemoryBlocks[blockId].numByteMap)
     {
-        const size_t indexAdr = BIT_ID_ADR(addr, blockId);
-        const uint8_t bitOff = BIT_ID_OFF(addr, blockId);
+        const size_t indexAdr = BIT_ID_ADR(getBlockIndex(pBlock), blockId);
+        const uint8_t bitOff = BIT_ID_OFF(getBlockIndex(pBlock), blockId);
         return (s_pBuddyHead->vpMemoryBlocks[blockId].bitmap[indexAdr] & bitOff) != 0;
     }
+    return false;
+}
+
+static inline void setOrderTag(buddy_block_t *pBlock, uint8_t tag)
+{
+    ASSERT(getBlockIndex(pBlock) < s_pBuddyHead->numOrderTags);
+    s_pBuddyHead->pOrderTags[getBlockIndex(pBlock)] = tag;
 }
 
 static inline buddy_block_t *getBrother(buddy_block_t *pBlock)
 {
-    size_t adr = (size_t)pBlock - (size_t)s_pBuddyHead->vpMemoryStart;
-    adr ^= BUDDY_BLOCK_SIZE << pBlock->blockid;
-    return (buddy_block_t *)(adr + (size_t)s_pBuddyHead->vpMemoryStart);
+    return &s_pBuddyHead->pDescriptors[getBlockIndex(pBlock) ^ ((size_t)1 << pBlock->blockid)];
 }
 
 static inline CRESULT buddy_init_memory_blocks(buddy_allocator_t *pBuddyHead)
@@ -68,25 +89,26 @@ static inline CRESULT buddy_init_memory_blocks(buddy_allocator_t *pBuddyHead)
         pBuddyHead->vpMemoryBlocks[i].block = NULL;
     }
 
-    buddy_block_t *start = (buddy_block_t *)pBuddyHead->vpMemoryStart;
+    buddy_block_t *start = pBuddyHead->pDescriptors;
 
     for (int16_t i = pBuddyHead->maxBlockSize - 1; i >= 0; i--)
     {
-        if ((pBuddyHead->memorySize & TOTAL_MEMORY_BLOCKID(i)) && sizeof(buddy_block_t) <= TOTAL_MEMORY_BLOCKID(i))
+        if (pBuddyHead->memorySize & TOTAL_MEMORY_BLOCKID(i))
         {
-            pBuddyHead->vpMemoryBlocks[i].block = (buddy_block_t *)start;
+            pBuddyHead->vpMemoryBlocks[i].block = start;
             start->next = NULL;
             start->prev = NULL;
             start->blockid = i;
 
             setBitMapBit(start, i, 1);
+            setOrderTag(start, i | BUDDY_TAG_FREE);
 
-            BUDDY_LOG("Created buddy_block at offset %d of size %d", (size_t)start - (size_t)pBuddyHead->vpMemoryStart,
+            BUDDY_LOG("Created buddy_block at offset %d of size %d", getBlockIndex(start) * BLOCK_SIZE_POW_TWO,
                       TOTAL_MEMORY_BLOCKID(i));
-            start = (buddy_block_t *)((size_t)start + TOTAL_MEMORY_BLOCKID(i));
+            start += (size_t)1 << i;
         }
     }
-    BUDDY_LOG("Total buddy_blocks allocated: %d", (size_t)start - (size_t)pBuddyHead->vpMemoryStart);
+    BUDDY_LOG("Total buddy_blocks allocated: %d", getBlockIndex(start));
 
     return OK;
 }
@@ -120,6 +142,28 @@ static CRESULT buddy_init_bitmap(buddy_allocator_t *pBuddyHead)
             start = (void *)((size_t)start + offset);
         }
     }
+
+    // Tags cover every minimum block, start in the middle of a block with no block heads
+    pBuddyHead->pOrderTags = (uint8_t *)start;
+    pBuddyHead->numOrderTags = memory;
+    memset(pBuddyHead->pOrderTags, BUDDY_TAG_NONE, memory);
+    start = (void *)((size_t)start + memory);
+    memory_loss += memory;
+
+    // Free list links live here instead of in the blocks themselves
+    const size_t padding = ALIGN_UP((size_t)start, sizeof(void *)) - (size_t)start;
+    pBuddyHead->pDescriptors = (buddy_block_t *)((size_t)start + padding);
+    start = (void *)((size_t)pBuddyHead->pDescriptors + memory * sizeof(buddy_block_t));
+    memory_loss += padding + memory * sizeof(buddy_block_t);
+
+    // Blocks are aligned in absolute address space, not only relative to vpMemoryStart
+    const size_t regionPadding = ALIGN_UP((size_t)start, BUDDY_REGION_ALIGN) - (size_t)start;
+    start = (void *)((size_t)start + regionPadding);
+    memory_loss += regionPadding;
+
+    if (memory_loss >= pBuddyHead->memorySize)
+        return NOT_ENOUGH_MEMORY_TO_INIT;
+
     pBuddyHead->vpMemoryStart = start;
     pBuddyHead->memorySize -= memory_loss;
     BUDDY_LOG("BITMAP loss: %ld", memory_loss);
@@ -130,8 +174,6 @@ static CRESULT buddy_init_bitmap(buddy_allocator_t *pBuddyHead)
 
 CRESULT buddy_init(void *vpSpace, size_t totalSize)
 {
-    ASSERT(sizeof(buddy_block_t) <= BLOCK_SIZE_POW_TWO);
-
     if (!vpSpace || !totalSize)
         return PARAM_ERROR;
 
@@ -155,9 +197,23 @@ CRESULT buddy_init(void *vpSpace, size_t totalSize)
 
     BUDDY_LOG("Size of buddy: %d\nSize of array: %d", sizeof(buddy_allocator_t), Num_Blocks * sizeof(buddy_block_t *));
 
-    buddy_init_bitmap(pBuddyHead);
+    memset(pBuddyHead->hot, 0, sizeof(pBuddyHead->hot));
+    memset(&pBuddyHead->stats, 0, sizeof(pBuddyHead->stats));
+    pBuddyHead->hotWatermark = 0;
+
+    resultCode = buddy_init_bitmap(pBuddyHead);
+    if (resultCode != OK)
+    {
+        s_pBuddyHead = NULL;
+        return resultCode;
+    }
+    for (size_t i = 0; i < pBuddyHead->numOrderTags; i++)
+    {
+        pBuddyHead->pDescriptors[i].dirty = 1;
+        pBuddyHead->pDescriptors[i].mark = 0;
+    }
     buddy_init_memory_blocks(pBuddyHead);
-    InitializeCriticalSectionAndSpinCount(&pBuddyHead->CriticalSection, 0x1);
+    LOCK_INIT(&pBuddyHead->CriticalSection, 0x1);
     return OK;
 }
 
@@ -232,22 +288,24 @@ static void buddy_split_once(buddy_block_t *toSplit, bool toRemove)
     if (!toSplit || !toSplit->blockid)
         return;
 
-    ASSERT(sizeof(buddy_block_t) <= TOTAL_MEMORY_BLOCKID(toSplit->blockid - 1));
     if (toRemove)
     {
         buddy_remove_from_current_list(toSplit);
     }
 
-    buddy_block_t *newBuddy = (buddy_block_t *)((size_t)toSplit + TOTAL_MEMORY_BLOCKID(toSplit->blockid - 1));
+    buddy_block_t *newBuddy = toSplit + ((size_t)1 << (toSplit->blockid - 1));
     newBuddy->prev = NULL;
     newBuddy->next = NULL;
     newBuddy->blockid = toSplit->blockid - 1;
     toSplit->blockid--;
+    setOrderTag(newBuddy, newBuddy->blockid | BUDDY_TAG_FREE);
+    s_pBuddyHead->stats.splits++;
+    TRACE(BUDDY_SPLIT, getBlockIndex(toSplit) * BLOCK_SIZE_POW_TWO, toSplit->blockid);
 
     buddy_insert_block(newBuddy);
 }
 
-static void *buddy_split_buddy_block(uint8_t blockid, uint8_t targetBlockid)
+static buddy_block_t *buddy_split_buddy_block(uint8_t blockid, uint8_t targetBlockid)
 {
     ASSERT(blockid > targetBlockid);
     ASSERT(blockid < s_pBuddyHead->maxBlockSize);
@@ -267,6 +325,118 @@ static void *buddy_split_buddy_block(uint8_t blockid, uint8_t targetBlockid)
     return toSplitStart;
 }
 
+static buddy_block_t *buddy_alloc_order(uint8_t order)
+{
+    buddy_block_t *pBlock;
+    if (s_pBuddyHead->vpMemoryBlocks[order].block)
+    {
+        ASSERT(order >= BUDDY_BITMAP_MIN_BLOCKID && getBitMapBit(s_pBuddyHead->vpMemoryBlocks[order].block, order));
+
+        pBlock = s_pBuddyHead->vpMemoryBlocks[order].block;
+        s_pBuddyHead->vpMemoryBlocks[order].block = s_pBuddyHead->vpMemoryBlocks[order].block->next;
+
+        if (s_pBuddyHead->vpMemoryBlocks[order].block)
+        {
+            s_pBuddyHead->vpMemoryBlocks[order].block->prev = NULL;
+        }
+
+        setBitMapBit(pBlock, order, 0);
+    }
+    else
+    {
+        uint8_t i;
+        for (i = order + 1; i < s_pBuddyHead->maxBlockSize; i++)
+        {
+            if (s_pBuddyHead->vpMemoryBlocks[i].block)
+                break;
+        }
+        if (i == s_pBuddyHead->maxBlockSize)
+            return NULL;
+
+        pBlock = buddy_split_buddy_block(i, order);
+    }
+
+    pBlock->next = NULL;
+    pBlock->prev = NULL;
+    return pBlock;
+}
+
+static void buddy_merge_propagate(buddy_block_t *pBuddyBlock);
+
+static void buddy_hot_drain_order(uint8_t order, size_t keep)
+{
+    buddy_hot_cache_t *hot = &s_pBuddyHead->hot[order];
+    while (hot->count > keep)
+    {
+        buddy_block_t *pBlock = hot->block;
+        hot->block = pBlock->next;
+        hot->count--;
+        s_pBuddyHead->stats.hotDrained++;
+
+        pBlock->next = NULL;
+        pBlock->blockid = order;
+        buddy_merge_propagate(pBlock);
+    }
+}
+
+void buddy_hot_cache_drain()
+{
+    if (!s_pBuddyHead)
+        return;
+
+    for (uint8_t order = 0; order < BUDDY_HOT_ORDERS; order++)
+        buddy_hot_drain_order(order, 0);
+}
+
+CRESULT buddy_hot_cache_set(size_t watermark)
+{
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    s_pBuddyHead->hotWatermark = watermark;
+    for (uint8_t order = 0; order < BUDDY_HOT_ORDERS; order++)
+        buddy_hot_drain_order(order, watermark);
+
+    return OK;
+}
+
+CRESULT buddy_get_stats(buddy_stats_t *result)
+{
+    if (!result)
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    *result = s_pBuddyHead->stats;
+    return OK;
+}
+
+static buddy_block_t *buddy_alloc_block(uint8_t order)
+{
+    buddy_block_t *pBlock = NULL;
+    if (order < BUDDY_HOT_ORDERS && s_pBuddyHead->hot[order].block)
+    {
+        // Recently freed block of the same order, was never merged so needs no split
+        pBlock = s_pBuddyHead->hot[order].block;
+        s_pBuddyHead->hot[order].block = pBlock->next;
+        s_pBuddyHead->hot[order].count--;
+        s_pBuddyHead->stats.hotHits++;
+        pBlock->next = NULL;
+    }
+    else
+    {
+        pBlock = buddy_alloc_order(order);
+        if (!pBlock && s_pBuddyHead->hotWatermark)
+        {
+            // Memory may be held by the hot caches in blocks that have to be merged first
+            buddy_hot_cache_drain();
+            pBlock = buddy_alloc_order(order);
+        }
+    }
+
+    return pBlock;
+}
+
 CRESULT buddy_alloc(size_t size, void **result)
 {
     if (!size || !result)
@@ -275,41 +445,240 @@ CRESULT buddy_alloc(size_t size, void **result)
         return SYSTEM_NOT_INITIALIZED;
 
     const size_t numBlocks = (size + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
+    const uint8_t order = BEST_FIT_BLOCKID(numBlocks);
+
+    if (order >= s_pBuddyHead->maxBlockSize)
+        return NOT_ENOUGH_MEMORY;
 
-    if (BEST_FIT_BLOCKID(numBlocks) >= s_pBuddyHead->maxBlockSize)
+    buddy_block_t *pBlock = buddy_alloc_block(order);
+    if (!pBlock)
         return NOT_ENOUGH_MEMORY;
 
-    if (s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block)
+    setOrderTag(pBlock, order);
+    *result = getBlockAddress(pBlock);
+    return OK;
+}
+
+static void buddy_free_block(buddy_block_t *pBuddyBlock, uint8_t order);
+
+// Largest piece starting at offset that is aligned to its own size and ends by end
+static inline uint8_t buddy_piece_order(size_t offset, size_t end)
+{
+    uint8_t piece = FLS64(end - offset) - 1;
+    if (offset)
     {
-        ASSERT(
-            BEST_FIT_BLOCKID(numBlocks) >= BUDDY_BITMAP_MIN_BLOCKID &&
-            getBitMapBit(s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block, BEST_FIT_BLOCKID(numBlocks)));
+        const uint8_t align = FLS64(offset & (~offset + 1)) - 1;
+        piece = align < piece ? align : piece;
+    }
+    return piece;
+}
 
-        *result = s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block;
-        s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block =
-            s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block->next;
+static void buddy_free_range(buddy_block_t *pBlock, size_t from, size_t to)
+{
+    while (from < to)
+    {
+        const uint8_t piece = buddy_piece_order(from, to);
+        buddy_block_t *pPiece = pBlock + from;
+        from += (size_t)1 << piece;
+
+        pPiece->blockid = piece;
+        pPiece->next = NULL;
+        pPiece->prev = NULL;
+        s_pBuddyHead->stats.trimmed += (size_t)1 << piece;
+        buddy_merge_propagate(pPiece);
+    }
+}
 
-        if (s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block)
-        {
-            s_pBuddyHead->vpMemoryBlocks[BEST_FIT_BLOCKID(numBlocks)].block->prev = NULL;
-        }
+// Keeps blocks [from, from + numBlocks) of an allocated block of given order and frees the rest.
+// Kept part is tagged as a run of aligned pieces so buddy_free can find them all, runFlag marks
+// the first piece as continuing a run that started in an earlier block.
+static void buddy_trim_block(buddy_block_t *pBlock, uint8_t order, size_t from, size_t numBlocks, uint8_t runFlag)
+{
+    const size_t to = from + numBlocks;
+    ASSERT(numBlocks && to <= ((size_t)1 << order));
 
-        setBitMapBit(*result, BEST_FIT_BLOCKID(numBlocks), 0);
+    setOrderTag(pBlock, order);
+    for (size_t offset = from; offset < to;)
+    {
+        const uint8_t piece = buddy_piece_order(offset, to);
+        setOrderTag(pBlock + offset, offset != from ? piece | BUDDY_TAG_RUN : piece | runFlag);
+        offset += (size_t)1 << piece;
     }
-    else
+
+    buddy_free_range(pBlock, 0, from);
+    buddy_free_range(pBlock, to, (size_t)1 << order);
+}
+
+CRESULT buddy_alloc_exact(size_t size, void **result)
+{
+    if (!size || !result)
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    const size_t numBlocks = (size + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
+    if (POWER_OF_TWO(numBlocks))
+        return buddy_alloc(size, result);
+
+    const uint8_t order = BEST_FIT_BLOCKID(numBlocks);
+    if (order >= s_pBuddyHead->maxBlockSize)
+        return NOT_ENOUGH_MEMORY;
+
+    buddy_block_t *pBlock = buddy_alloc_block(order);
+    if (!pBlock)
+        return NOT_ENOUGH_MEMORY;
+
+    buddy_trim_block(pBlock, order, 0, numBlocks, 0);
+    *result = getBlockAddress(pBlock);
+    return OK;
+}
+
+CRESULT buddy_alloc_aligned(size_t size, size_t align, void **result)
+{
+    if (!size || !result || !POWER_OF_TWO(align))
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    if (align <= BLOCK_SIZE_POW_TWO)
+        return buddy_alloc_exact(size, result);
+
+    const size_t numBlocks = (size + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
+    const size_t alignBlocks = align / BLOCK_SIZE_POW_TWO;
+    const size_t regionAlign = (size_t)s_pBuddyHead->vpMemoryStart & (~(size_t)s_pBuddyHead->vpMemoryStart + 1);
+
+    // Blocks are naturally aligned only up to the region alignment, beyond that take room to slide
+    const size_t needed = regionAlign >= align ? (numBlocks > alignBlocks ? numBlocks : alignBlocks)
+                                               : numBlocks + alignBlocks - 1;
+    const uint8_t order = BEST_FIT_BLOCKID(needed);
+    if (order >= s_pBuddyHead->maxBlockSize)
+        return NOT_ENOUGH_MEMORY;
+
+    buddy_block_t *pBlock = buddy_alloc_block(order);
+    if (!pBlock)
+        return NOT_ENOUGH_MEMORY;
+
+    const size_t address = (size_t)getBlockAddress(pBlock);
+    const size_t from = (ALIGN_UP(address, align) - address) / BLOCK_SIZE_POW_TWO;
+    buddy_trim_block(pBlock, order, from, numBlocks, 0);
+
+    *result = getBlockAddress(pBlock + from);
+    return OK;
+}
+
+static inline void buddy_extent_consider(size_t runStart, size_t runLength, size_t numBlocks, buddy_block_t **best,
+                                         size_t *bestLength)
+{
+    if (runLength >= numBlocks && (!*best || runLength < *bestLength))
     {
-        uint8_t i;
-        for (i = BEST_FIT_BLOCKID(numBlocks) + 1; i < s_pBuddyHead->maxBlockSize; i++)
+        *best = &s_pBuddyHead->pDescriptors[runStart];
+        *bestLength = runLength;
+    }
+}
+
+// Smallest run of adjacent free blocks that holds numBlocks, found by walking block heads in address order
+static buddy_block_t *buddy_find_extent(size_t numBlocks)
+{
+    buddy_block_t *best = NULL;
+    size_t bestLength = 0;
+    size_t runStart = 0, runLength = 0;
+
+    for (size_t index = 0; index < s_pBuddyHead->numOrderTags;)
+    {
+        const uint8_t tag = s_pBuddyHead->pOrderTags[index];
+        if (tag == BUDDY_TAG_NONE)
+            break;
+
+        if (tag & BUDDY_TAG_FREE)
         {
-            if (s_pBuddyHead->vpMemoryBlocks[i].block)
-                break;
+            if (!runLength)
+                runStart = index;
+            runLength += (size_t)1 << (tag & ~BUDDY_TAG_FREE);
         }
-        if (i == s_pBuddyHead->maxBlockSize)
-            return NOT_ENOUGH_MEMORY;
+        else
+        {
+            buddy_extent_consider(runStart, runLength, numBlocks, &best, &bestLength);
+            runLength = 0;
+        }
+        index += (size_t)1 << (tag & ~(BUDDY_TAG_FREE | BUDDY_TAG_HOT | BUDDY_TAG_RUN));
+    }
+    buddy_extent_consider(runStart, runLength, numBlocks, &best, &bestLength);
+
+    return best;
+}
+
+// Takes numBlocks from the start of a free extent, block by block, as one run. runFlag marks the
+// first block as continuing an allocation that ends right before the extent
+static void buddy_claim_extent(buddy_block_t *pStart, size_t numBlocks, uint8_t runFlag)
+{
+    buddy_block_t *pBlock = pStart;
+    while (numBlocks)
+    {
+        const uint8_t order = pBlock->blockid;
+        const size_t blocks = (size_t)1 << order;
+        ASSERT(s_pBuddyHead->pOrderTags[getBlockIndex(pBlock)] == (order | BUDDY_TAG_FREE));
+
+        buddy_remove_from_current_list(pBlock);
+        setBitMapBit(pBlock, order, 0);
 
-        *result = buddy_split_buddy_block(i, BEST_FIT_BLOCKID(numBlocks));
+        const size_t kept = numBlocks < blocks ? numBlocks : blocks;
+        buddy_trim_block(pBlock, order, 0, kept, pBlock != pStart ? BUDDY_TAG_RUN : runFlag);
+        numBlocks -= kept;
+        pBlock += blocks;
     }
+}
+
+CRESULT buddy_alloc_large(size_t size, void **result)
+{
+    if (!size || !result)
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    const size_t numBlocks = (size + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
+    if (BEST_FIT_BLOCKID(numBlocks) < s_pBuddyHead->maxBlockSize && buddy_alloc_exact(size, result) == OK)
+        return OK;
+
+    // Hot blocks are not free in tags, give them back so they can join extents
+    buddy_hot_cache_drain();
+    buddy_block_t *pStart = buddy_find_extent(numBlocks);
+    if (!pStart)
+        return NOT_ENOUGH_MEMORY;
 
+    buddy_claim_extent(pStart, numBlocks, 0);
+    s_pBuddyHead->stats.largeExtents++;
+    *result = getBlockAddress(pStart);
+    return OK;
+}
+
+CRESULT buddy_extend(void *ptr, size_t size)
+{
+    if (!ptr)
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+
+    const size_t usable = buddy_usable_size(ptr);
+    if (!usable)
+        return BUDDY_FREE_NOT_VALID_ADDRES;
+    if (size <= usable)
+        return OK;
+
+    // Index right after the allocation is always a block head, a bigger block can't hold it
+    const size_t numBlocks = (size - usable + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
+    const size_t end = getBlockIndex(getDescriptor(ptr)) + usable / BLOCK_SIZE_POW_TWO;
+    size_t available = 0;
+    while (available < numBlocks && end + available < s_pBuddyHead->numOrderTags)
+    {
+        const uint8_t tag = s_pBuddyHead->pOrderTags[end + available];
+        if (tag == BUDDY_TAG_NONE || !(tag & BUDDY_TAG_FREE))
+            break;
+        available += (size_t)1 << (tag & ~BUDDY_TAG_FREE);
+    }
+    if (available < numBlocks)
+        return NOT_ENOUGH_MEMORY;
+
+    buddy_claim_extent(&s_pBuddyHead->pDescriptors[end], numBlocks, BUDDY_TAG_RUN);
     return OK;
 }
 
@@ -320,40 +689,210 @@ static void buddy_merge_propagate(buddy_block_t *pBuddyBlock)
 
     while (true)
     {
-        if (getBitMapBit(pBuddyBlock, pBuddyBlock->blockid))
+        // Brother state comes from its tag, unlinking it only touches descriptors
+        buddy_block_t *brother = getBrother(pBuddyBlock);
+        const size_t brotherTag = getBlockIndex(brother);
+        if (brotherTag < s_pBuddyHead->numOrderTags &&
+            s_pBuddyHead->pOrderTags[brotherTag] == (pBuddyBlock->blockid | BUDDY_TAG_FREE))
         {
-            buddy_block_t *brother = getBrother(pBuddyBlock);
+            ASSERT(getBitMapBit(pBuddyBlock, pBuddyBlock->blockid));
             buddy_remove_from_current_list(brother);
+            setOrderTag(OLD_BROTHER(pBuddyBlock, brother), BUDDY_TAG_NONE);
             pBuddyBlock = YOUNG_BROTHER(pBuddyBlock, brother);
             setBitMapBit(pBuddyBlock, pBuddyBlock->blockid, 0);
             pBuddyBlock->blockid++;
+            s_pBuddyHead->stats.merges++;
+            TRACE(BUDDY_MERGE, getBlockIndex(pBuddyBlock) * BLOCK_SIZE_POW_TWO, pBuddyBlock->blockid);
         }
         else
         {
             setBitMapBit(pBuddyBlock, pBuddyBlock->blockid, 1);
+            setOrderTag(pBuddyBlock, pBuddyBlock->blockid | BUDDY_TAG_FREE);
             buddy_insert_block(pBuddyBlock);
             break;
         }
     }
 }
 
-CRESULT buddy_free(void *ptr, size_t size)
+static inline int buddy_allocated_order(const void *ptr)
+{
+    if (ptr < s_pBuddyHead->vpMemoryStart || (((size_t)ptr - (size_t)s_pBuddyHead->vpMemoryStart) % BLOCK_SIZE_POW_TWO))
+        return -1;
+
+    const size_t index = getBlockIndex(getDescriptor(ptr));
+    if (index >= s_pBuddyHead->numOrderTags ||
+        s_pBuddyHead->pOrderTags[index] & (BUDDY_TAG_FREE | BUDDY_TAG_HOT | BUDDY_TAG_RUN))
+        return -1;
+
+    return s_pBuddyHead->pOrderTags[index];
+}
+
+// Next piece of an exact allocation run, or -1 once the run ends
+static inline int buddy_run_next_order(size_t index)
+{
+    if (index >= s_pBuddyHead->numOrderTags)
+        return -1;
+
+    const uint8_t tag = s_pBuddyHead->pOrderTags[index];
+    if ((tag & (BUDDY_TAG_FREE | BUDDY_TAG_HOT | BUDDY_TAG_RUN)) != BUDDY_TAG_RUN)
+        return -1;
+
+    return tag & ~BUDDY_TAG_RUN;
+}
+
+CRESULT buddy_free(void *ptr)
 {
-    if (!ptr || !size)
+    if (!ptr)
         return PARAM_ERROR;
     if (!s_pBuddyHead)
         return SYSTEM_NOT_INITIALIZED;
 
-    const size_t numBlocks = (size + BLOCK_SIZE_POW_TWO - 1) / BLOCK_SIZE_POW_TWO;
-    buddy_block_t *const pBuddyBlock = ptr;
-    pBuddyBlock->blockid = BEST_FIT_BLOCKID(size / BLOCK_SIZE_POW_TWO);
+    // Order comes from the tag, so a pointer that is not an allocated block head is refused
+    const int order = buddy_allocated_order(ptr);
+    if (order < 0)
+        return BUDDY_FREE_NOT_VALID_ADDRES;
+
+    buddy_block_t *pBuddyBlock = getDescriptor(ptr);
+    pBuddyBlock->mark = 0;
+    for (int piece = order; piece >= 0;)
+    {
+        // Freeing a piece never merges with the following ones, they are still allocated
+        const size_t next = getBlockIndex(pBuddyBlock) + ((size_t)1 << piece);
+        for (buddy_block_t *pDirty = pBuddyBlock; pDirty < &s_pBuddyHead->pDescriptors[next]; pDirty++)
+            pDirty->dirty = 1;
+        buddy_free_block(pBuddyBlock, piece);
+
+        pBuddyBlock = &s_pBuddyHead->pDescriptors[next];
+        piece = buddy_run_next_order(next);
+    }
+
+    return OK;
+}
+
+static void buddy_free_block(buddy_block_t *pBuddyBlock, uint8_t order)
+{
+    pBuddyBlock->blockid = order;
     pBuddyBlock->next = NULL;
     pBuddyBlock->prev = NULL;
+
+    if (order < BUDDY_HOT_ORDERS && s_pBuddyHead->hotWatermark)
+    {
+        // Keep block whole, it stays allocated to the buddy system until drained
+        buddy_hot_cache_t *hot = &s_pBuddyHead->hot[order];
+        setOrderTag(pBuddyBlock, order | BUDDY_TAG_HOT);
+        pBuddyBlock->next = hot->block;
+        hot->block = pBuddyBlock;
+        hot->count++;
+        s_pBuddyHead->stats.hotFrees++;
+
+        if (hot->count > s_pBuddyHead->hotWatermark)
+            buddy_hot_drain_order(order, s_pBuddyHead->hotWatermark / 2);
+        return;
+    }
+
     buddy_merge_propagate(pBuddyBlock);
+}
+
+size_t buddy_usable_size(const void *ptr)
+{
+    if (!ptr || !s_pBuddyHead)
+        return 0;
+
+    size_t numBlocks = 0;
+    size_t index = getBlockIndex(getDescriptor(ptr));
+    for (int piece = buddy_allocated_order(ptr); piece >= 0; piece = buddy_run_next_order(index))
+    {
+        numBlocks += (size_t)1 << piece;
+        index += (size_t)1 << piece;
+    }
+    return numBlocks * BLOCK_SIZE_POW_TWO;
+}
+
+// Page to allocation lookup. Blocks are aligned to their order, so the first tagged index found by
+// clearing low bits is the head of the piece holding ptr. Tags inside a live allocation don't change
+void *buddy_block_start(const void *ptr)
+{
+    if (!ptr || !s_pBuddyHead || ptr < s_pBuddyHead->vpMemoryStart)
+        return NULL;
+
+    size_t index = getBlockIndex(getDescriptor(ptr));
+    if (index >= s_pBuddyHead->numOrderTags)
+        return NULL;
+
+    while (true)
+    {
+        size_t head = index;
+        for (uint8_t order = 1; s_pBuddyHead->pOrderTags[head] == BUDDY_TAG_NONE; order++)
+        {
+            if (order >= s_pBuddyHead->maxBlockSize)
+                return NULL;
+            head = index & ~(((size_t)1 << order) - 1);
+        }
+
+        const uint8_t tag = s_pBuddyHead->pOrderTags[head];
+        if (tag & (BUDDY_TAG_FREE | BUDDY_TAG_HOT) || index >= head + ((size_t)1 << (tag & ~BUDDY_TAG_RUN)))
+            return NULL;
+        if (!(tag & BUDDY_TAG_RUN))
+            return getBlockAddress(&s_pBuddyHead->pDescriptors[head]);
+
+        // Piece of an exact allocation run, the run starts before it
+        if (!head)
+            return NULL;
+        index = head - 1;
+    }
+}
+
+CRESULT buddy_set_mark(void *ptr, uint8_t mark)
+{
+    if (!ptr)
+        return PARAM_ERROR;
+    if (!s_pBuddyHead)
+        return SYSTEM_NOT_INITIALIZED;
+    if (buddy_allocated_order(ptr) < 0)
+        return BUDDY_FREE_NOT_VALID_ADDRES;
 
+    getDescriptor(ptr)->mark = mark;
     return OK;
 }
 
+uint8_t buddy_get_mark(const void *ptr)
+{
+    if (!ptr || !s_pBuddyHead || buddy_allocated_order(ptr) < 0)
+        return 0;
+
+    return getDescriptor(ptr)->mark;
+}
+
+// Only frees make memory dirty, blocks trimmed off an allocation were never given out
+void buddy_assume_zeroed()
+{
+    if (!s_pBuddyHead)
+        return;
+
+    for (size_t i = 0; i < s_pBuddyHead->numOrderTags; i++)
+    {
+        s_pBuddyHead->pDescriptors[i].dirty = 0;
+    }
+}
+
+bool buddy_is_zeroed(const void *ptr, size_t size)
+{
+    if (!ptr || !s_pBuddyHead || ptr < s_pBuddyHead->vpMemoryStart)
+        return false;
+
+    const size_t first = getBlockIndex(getDescriptor(ptr));
+    const size_t last = getBlockIndex(getDescriptor((const char *)ptr + size - 1));
+    if (last >= s_pBuddyHead->numOrderTags)
+        return false;
+
+    for (size_t i = first; i <= last; i++)
+    {
+        if (s_pBuddyHead->pDescriptors[i].dirty)
+            return false;
+    }
+    return true;
+}
+
 CRESULT buddy_destroy()
 {
     s_pBuddyHead = NULL;
@@ -367,8 +906,7 @@ void buddy_print_memory_offsets()
     {
         printf("[ %4d ] ", 1 << i);
         for (buddy_block_t *curr = s_pBuddyHead->vpMemoryBlocks[i].block; curr; curr = curr->next)
-            printf(" (%d, %d)", (size_t)curr - (size_t)s_pBuddyHead->vpMemoryStart,
-                   ((size_t)curr - (size_t)s_pBuddyHead->vpMemoryStart) / BLOCK_SIZE_POW_TWO >> curr->blockid);
+            printf(" (%d, %d)", getBlockIndex(curr) * BLOCK_SIZE_POW_TWO, getBlockIndex(curr) >> curr->blockid);
         printf("\n");
     }
 }
@@ -23,4 +23,6 @@ void printCode(int code)
         printf("SLAB_DEALLOC_NOT_VALID_ADDRES\n");
     if (code & FAIL)
         printf("FAIL\n");
+    if (code & BUDDY_FREE_NOT_VALID_ADDRES)
+        printf("BUDDY_FREE_NOT_VALID_ADDRES\n");
 }
\ No newline at end of file
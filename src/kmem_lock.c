@@ -0,0 +1,65 @@
+#include "kmem_lock.h"
+#include <string.h>
+
+#ifdef LOCK_STATS
+
+BOOL kmem_lock_init(kmem_lock_t *lock, DWORD spinCount)
+{
+    if (!lock)
+        return FALSE;
+
+    lock->depth = 0;
+    lock->acquiredAt = 0;
+    memset(&lock->stats, 0, sizeof(lock->stats));
+    return InitializeCriticalSectionAndSpinCount(&lock->CriticalSection, spinCount);
+}
+
+void kmem_lock_enter(kmem_lock_t *lock)
+{
+    if (!TryEnterCriticalSection(&lock->CriticalSection))
+    {
+        const uint64_t start = read_timestamp();
+        EnterCriticalSection(&lock->CriticalSection);
+        const uint64_t wait = read_timestamp() - start;
+
+        lock->stats.contended++;
+        lock->stats.waitTotal += wait;
+        if (wait > lock->stats.waitMax)
+            lock->stats.waitMax = wait;
+    }
+
+    // Critical sections are recursive, only outermost enter is an acquisition
+    if (lock->depth++ == 0)
+    {
+        lock->stats.acquisitions++;
+        lock->acquiredAt = read_timestamp();
+    }
+}
+
+BOOL kmem_lock_try_enter(kmem_lock_t *lock)
+{
+    if (!TryEnterCriticalSection(&lock->CriticalSection))
+        return FALSE;
+
+    if (lock->depth++ == 0)
+    {
+        lock->stats.acquisitions++;
+        lock->acquiredAt = read_timestamp();
+    }
+    return TRUE;
+}
+
+void kmem_lock_leave(kmem_lock_t *lock)
+{
+    ASSERT(lock->depth > 0);
+    if (--lock->depth == 0)
+    {
+        const uint64_t hold = read_timestamp() - lock->acquiredAt;
+        lock->stats.holdTotal += hold;
+        if (hold > lock->stats.holdMax)
+            lock->stats.holdMax = hold;
+    }
+    LeaveCriticalSection(&lock->CriticalSection);
+}
+
+#endif // LOCK_STATS
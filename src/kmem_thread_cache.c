@@ -0,0 +1,178 @@
+#include "slab_impl.h"
+#include <string.h>
+#include <windows.h>
+
+// Per thread kmalloc state. Allocations come from per class lists that a miss refills under one class
+// lock, each refill of a list taking a batch more than the last. kfree only records the pointer, nothing
+// is read or written through it until the recorded batch goes to kmem_buffer_free_checked, which checks
+// each pointer under the buddy and class locks like a direct kfree. Freed buffers are therefore reused
+// only after they passed those checks. Lists and recorded frees go back from the FLS callback when the
+// thread exits, or when reclaim asks.
+
+typedef struct kmem_thread_list_struct
+{
+    void *pHead;
+    uint32_t count;
+    uint32_t refill; // Objects the next refill takes, starts at one batch
+} kmem_thread_list_t;
+
+typedef struct kmem_thread_cache_struct
+{
+    kmem_thread_list_t list[BUFFER_ENTRY_NUM];
+    const void *pFreed[KMEM_THREAD_FREE_MAX]; // Recorded by kfree, not checked yet
+    int numFreed;
+} kmem_thread_cache_t;
+
+static THREAD_LOCAL kmem_thread_cache_t *s_threadCache = NULL;
+static THREAD_LOCAL uint32_t s_threadCacheEpoch = 0;
+static volatile uint32_t s_kmemEpoch = 0; // Bumped by kmem_init, caches of older epochs lived in a gone arena
+static volatile LONG s_threadCacheOn = 0;
+static THREAD_LOCAL LONG s_threadDrained = 0;
+static volatile LONG s_drainRequest = 0; // Bumped by reclaim, threads that saw an older value drain
+static DWORD s_threadCacheSlot = FLS_OUT_OF_INDEXES;
+
+static uint32_t kmem_thread_batch(int index)
+{
+    const size_t batch = KMEM_THREAD_BATCH_BYTES / kmalloc_class_size(index);
+    if (batch < 1)
+        return 1;
+    return batch > KMEM_THREAD_BATCH_MAX ? KMEM_THREAD_BATCH_MAX : (uint32_t)batch;
+}
+
+static uint32_t kmem_thread_limit_max(int index)
+{
+    const size_t limit = KMEM_THREAD_LIMIT_BYTES / kmalloc_class_size(index);
+    const uint32_t batch = kmem_thread_batch(index);
+    return limit < batch ? batch : (uint32_t)limit;
+}
+
+static void kmem_thread_release_freed(kmem_thread_cache_t *cache)
+{
+    const int count = cache->numFreed;
+    cache->numFreed = 0;
+    kmem_buffer_free_checked(cache->pFreed, count);
+}
+
+static void kmem_thread_cache_drain(kmem_thread_cache_t *cache)
+{
+    kmem_thread_release_freed(cache);
+    for (int i = 0; i < BUFFER_ENTRY_NUM; i++)
+    {
+        kmem_thread_list_t *list = &cache->list[i];
+        if (list->count)
+            kmem_buffer_free_bulk(i, list->pHead);
+        list->pHead = NULL;
+        list->count = 0;
+        list->refill = kmem_thread_batch(i);
+    }
+}
+
+static void WINAPI kmem_thread_cache_exit(void *data)
+{
+    // Thread locals are still valid here. A cache of an older epoch belongs to a gone arena
+    if (data && data == s_threadCache && s_threadCacheEpoch == s_kmemEpoch)
+    {
+        kmem_thread_cache_drain(s_threadCache);
+        *(void **)s_threadCache = NULL;
+        kmem_buffer_free_bulk(kmalloc_index(sizeof(kmem_thread_cache_t)), s_threadCache);
+    }
+    s_threadCache = NULL;
+}
+
+static kmem_thread_cache_t *kmem_thread_cache_get()
+{
+    if (s_threadCache && s_threadCacheEpoch == s_kmemEpoch)
+    {
+        if (s_threadDrained != s_drainRequest)
+        {
+            s_threadDrained = s_drainRequest;
+            kmem_thread_cache_drain(s_threadCache);
+        }
+        return s_threadCache;
+    }
+
+    // Cache itself comes straight from its class so it never sits in a thread list
+    kmem_thread_cache_t *cache = NULL;
+    if (!kmem_buffer_alloc_bulk(kmalloc_index(sizeof(kmem_thread_cache_t)), 1, (void **)&cache))
+        return NULL;
+
+    memset(cache, 0, sizeof(*cache));
+    for (int i = 0; i < BUFFER_ENTRY_NUM; i++)
+    {
+        cache->list[i].refill = kmem_thread_batch(i);
+    }
+    s_threadCache = cache;
+    s_threadCacheEpoch = s_kmemEpoch;
+    s_threadDrained = s_drainRequest;
+    FlsSetValue(s_threadCacheSlot, cache);
+    return cache;
+}
+
+void kmem_thread_cache_init()
+{
+    if (s_threadCacheSlot == FLS_OUT_OF_INDEXES)
+        s_threadCacheSlot = FlsAlloc(kmem_thread_cache_exit);
+
+    s_kmemEpoch++;
+    s_threadCacheOn = s_threadCacheSlot != FLS_OUT_OF_INDEXES;
+}
+
+void *kmem_thread_alloc(int index)
+{
+    if (!s_threadCacheOn)
+        return NULL;
+    kmem_thread_cache_t *cache = kmem_thread_cache_get();
+    if (!cache)
+        return NULL;
+
+    kmem_thread_list_t *list = &cache->list[index];
+    if (!list->pHead)
+    {
+        // A thread that keeps missing takes more per refill, up to the list limit
+        list->count = kmem_buffer_alloc_bulk(index, list->refill, &list->pHead);
+        if (!list->count)
+            return NULL;
+        const uint32_t batch = kmem_thread_batch(index);
+        if (list->refill + batch <= kmem_thread_limit_max(index))
+            list->refill += batch;
+    }
+
+    void *obj = list->pHead;
+    list->pHead = *(void **)obj;
+    list->count--;
+    return obj;
+}
+
+bool kmem_thread_free(const void *objp)
+{
+    if (!s_threadCacheOn)
+        return false;
+    kmem_thread_cache_t *cache = kmem_thread_cache_get();
+    if (!cache)
+        return false;
+
+    cache->pFreed[cache->numFreed++] = objp;
+    if (cache->numFreed == KMEM_THREAD_FREE_MAX)
+        kmem_thread_release_freed(cache);
+    return true;
+}
+
+int kmem_thread_cache_enable(int enabled)
+{
+    const LONG previous = InterlockedExchange(&s_threadCacheOn, enabled && s_threadCacheSlot != FLS_OUT_OF_INDEXES);
+    if (!enabled)
+        kmem_thread_cache_flush();
+    return previous;
+}
+
+void kmem_thread_cache_flush()
+{
+    if (s_threadCache && s_threadCacheEpoch == s_kmemEpoch)
+        kmem_thread_cache_drain(s_threadCache);
+}
+
+void kmem_thread_cache_reclaim()
+{
+    InterlockedIncrement(&s_drainRequest);
+    kmem_thread_cache_flush();
+}
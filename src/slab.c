@@ -1,17 +1,68 @@
 #include "buddy/buddy.h"
 #include "slab_impl.h"
+#include "trace.h"
 #include <string.h>
 
-#define BUFFER_SIZE_MAX 17
-#define BUFFER_SIZE_MIN 5
-#define BUFFER_ENTRY_NUM (BUFFER_SIZE_MAX - BUFFER_SIZE_MIN + 1)
-
 kmem_cache_t *s_cacheHead;
 kmem_buffer_t *s_bufferHead;
+static kmem_cache_t *s_cacheChain;
+
+// Reclaim state, guarded by s_cacheHead lock like the cache chain
+typedef struct kmem_shrinker_entry_struct
+{
+    kmem_shrinker_t shrink;
+    void *context;
+} kmem_shrinker_entry_t;
+
+static kmem_shrinker_entry_t s_shrinkers[KMEM_MAX_SHRINKERS];
+static kmem_reclaim_stats_t s_reclaimStats;
+static uint64_t s_reclaimPass;
+static uint64_t s_kmemClock; // Bumped without a lock, only orders caches for reclaim
+
+typedef struct kmem_reclaimer_struct
+{
+    HANDLE thread;
+    volatile LONG stop;
+    volatile LONG running;
+    unsigned periodMs;
+    unsigned idlePasses;
+    unsigned batch;
+    volatile uint32_t pass; // Read without locks to stamp slabs going EMPTY
+} kmem_reclaimer_t;
 
-static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name, size_t size, void (*ctor)(void *),
-                                         void (*dtor)(void *));
+static kmem_reclaimer_t s_reclaimer;
+
+extern buddy_allocator_t *s_pBuddyHead;
+
+static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name, size_t size, size_t align,
+                                         enum Slab_Color colorMode, void (*ctor)(void *), void (*dtor)(void *));
 static int slab_deallocate_list(kmem_slab_t** head);
+static int kmem_cache_shrink_locked(kmem_cache_t *cache);
+
+static void kmem_cache_chain_add(kmem_cache_t *cache)
+{
+    cache->prev = NULL;
+    cache->next = s_cacheChain;
+    if (s_cacheChain)
+    {
+        s_cacheChain->prev = cache;
+    }
+    s_cacheChain = cache;
+}
+
+static void kmem_cache_chain_remove(kmem_cache_t *cache)
+{
+    if (cache->prev)
+        cache->prev->next = cache->next;
+    else
+        s_cacheChain = cache->next;
+
+    if (cache->next)
+        cache->next->prev = cache->prev;
+
+    cache->next = NULL;
+    cache->prev = NULL;
+}
 
 static void kmem_buffer_init()
 {
@@ -20,15 +71,11 @@ static void kmem_buffer_init()
 
     for (int i = 0; i < BUFFER_ENTRY_NUM; i++)
     {
-        s_bufferHead[i].size = 1 << i + BUFFER_SIZE_MIN;
-        s_bufferHead[i].l1CacheFiller = 0;
-        s_bufferHead[i].pSlab[FULL] = NULL;
-        s_bufferHead[i].pSlab[HAS_SPACE] = NULL;
-        s_bufferHead[i].pSlab[EMPTY] = NULL;
-        if (!InitializeCriticalSectionAndSpinCount(&s_bufferHead[i].CriticalSection, 0))
-        {
-            ASSERT(false);
-        }
+        char name[NAME_MAX_LEN];
+        const size_t size = kmalloc_class_size(i);
+        sprintf_s(name, NAME_MAX_LEN, "size-%llu", (unsigned long long)size);
+        kmem_create_cache_init_state(&s_bufferHead[i], name, size, 0, SLAB_COLOR_L1, NULL, NULL);
+        kmem_cache_chain_add(&s_bufferHead[i]);
     }
     SLAB_LOG("Initialized buffer memory %ld\n", s_bufferHead);
 }
@@ -39,21 +86,31 @@ static void kmem_cache_init()
         return;
 
     s_cacheHead = (kmem_cache_t *)(s_bufferHead + BUFFER_ENTRY_NUM);
-    kmem_create_cache_init_state(s_cacheHead, "CacheHead\0", sizeof(kmem_cache_t), NULL, NULL);
+    kmem_create_cache_init_state(s_cacheHead, "CacheHead\0", sizeof(kmem_cache_t), 0, SLAB_COLOR_L1, NULL,
+                                 NULL);
+    kmem_cache_chain_add(s_cacheHead);
 }
 
-void kmem_init(void *space, int block_num)
+static void kmem_init_arena(void *space, int block_num, bool zeroed)
 {
     ASSERT(BUFFER_SIZE_MAX >= BUFFER_SIZE_MIN);
     s_cacheHead = NULL;
+    s_cacheChain = NULL;
+    memset(s_shrinkers, 0, sizeof(s_shrinkers));
+    memset(&s_reclaimStats, 0, sizeof(s_reclaimStats));
+    s_reclaimPass = 0;
+    s_kmemClock = 0;
 
     int code = buddy_init(space, (size_t)block_num * BLOCK_SIZE);
+    if (code == OK && zeroed)
+        buddy_assume_zeroed();
     code |= buddy_alloc(sizeof(kmem_buffer_t) * BUFFER_ENTRY_NUM + sizeof(kmem_cache_t), (void **)&s_bufferHead);
 
     if (code == OK)
     {
         kmem_buffer_init();
         kmem_cache_init();
+        kmem_thread_cache_init();
     }
     else
     {
@@ -61,131 +118,536 @@ void kmem_init(void *space, int block_num)
     }
 }
 
-static void *slab_allocate_has_space(kmem_slab_t *pSlab[], CRESULT *retCode)
+void kmem_init(void *space, int block_num)
+{
+    kmem_init_arena(space, block_num, false);
+}
+
+void kmem_init_zeroed(void *space, int block_num)
+{
+    kmem_init_arena(space, block_num, true);
+}
+
+// Puts slab in front of its occupancy bucket, buckets follow each other fullest first
+static void kmem_partial_insert(kmem_cache_t *cache, kmem_slab_t *slab)
 {
-    if (!pSlab || !pSlab[HAS_SPACE])
+    const int bucket = slab->bucket = SLAB_OCCUPANCY_BUCKET(slab);
+    ASSERT(bucket < KMEM_PARTIAL_BUCKETS);
+
+    kmem_slab_t *prev = cache->pPartialTail;
+    for (int i = bucket; i >= 0; i--)
     {
-        *retCode |= PARAM_ERROR;
-        return NULL;
+        if (cache->pPartialBucket[i])
+        {
+            prev = cache->pPartialBucket[i]->prev;
+            break;
+        }
     }
+    slab_list_insert_after(&cache->pSlab[HAS_SPACE], prev, slab);
+    cache->pPartialBucket[bucket] = slab;
+    if (!slab->next)
+        cache->pPartialTail = slab;
+}
 
-    void *result;
-    kmem_slab_t *slab = pSlab[HAS_SPACE];
-    CRESULT code = slab_allocate(slab, &result);
-    if (code != OK)
+static void kmem_partial_remove(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    if (cache->pPartialBucket[slab->bucket] == slab)
+        cache->pPartialBucket[slab->bucket] = slab->next && slab->next->bucket == slab->bucket ? slab->next : NULL;
+    if (cache->pPartialTail == slab)
+        cache->pPartialTail = slab->prev;
+    slab_list_delete(&cache->pSlab[HAS_SPACE], slab);
+}
+
+static void kmem_partial_reset(kmem_cache_t *cache)
+{
+    memset(cache->pPartialBucket, 0, sizeof(cache->pPartialBucket));
+    cache->pPartialTail = NULL;
+}
+
+static void kmem_slab_detach(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    switch (slab->list)
     {
-        *retCode |= code;
-        ASSERT(0 && "allocate failed");
-        return NULL;
+    case EMPTY:
+        if (cache->pEmptyTail == slab)
+            cache->pEmptyTail = slab->prev;
+        slab_list_delete(&cache->pSlab[EMPTY], slab);
+        break;
+    case HAS_SPACE:
+        kmem_partial_remove(cache, slab);
+        break;
+    case FULL:
+        slab_list_delete(&cache->pSlab[FULL], slab);
+        break;
+    case CPU_ACTIVE:
+        ASSERT(cache->cpuSlab[slab->cpu].pActive == slab);
+        cache->cpuSlab[slab->cpu].pActive = NULL;
+        break;
+    case CPU_PARTIAL:
+        slab_list_delete(&cache->cpuSlab[slab->cpu].pPartial, slab);
+        cache->cpuSlab[slab->cpu].numPartial--;
+        break;
+    default:
+        break;
     }
+    slab->list = NUM_TYPES;
+}
 
-    int x = NUMBER_OF_OBJECTS_IN_SLAB(slab);
-    if (pSlab[HAS_SPACE]->takenSlots == NUMBER_OF_OBJECTS_IN_SLAB(slab))
+static void kmem_slab_attach(kmem_cache_t *cache, kmem_slab_t *slab, int list, int cpu)
+{
+    ASSERT(slab->list == NUM_TYPES && slab->cache == cache);
+    switch (list)
     {
-        slab_list_delete(&pSlab[HAS_SPACE], slab);
-        slab_list_insert(&pSlab[FULL], slab);
+    case EMPTY:
+        slab->emptySince = s_reclaimer.pass;
+        if (!cache->pSlab[EMPTY])
+            cache->pEmptyTail = slab;
+        slab_list_insert(&cache->pSlab[EMPTY], slab);
+        break;
+    case HAS_SPACE:
+        kmem_partial_insert(cache, slab);
+        break;
+    case FULL:
+        slab_list_insert(&cache->pSlab[FULL], slab);
+        break;
+    case CPU_ACTIVE:
+        ASSERT(!cache->cpuSlab[cpu].pActive);
+        cache->cpuSlab[cpu].pActive = slab;
+        break;
+    case CPU_PARTIAL:
+        slab_list_insert(&cache->cpuSlab[cpu].pPartial, slab);
+        cache->cpuSlab[cpu].numPartial++;
+        break;
+    default:
+        ASSERT(false);
+        break;
     }
+    slab->list = list;
+    slab->cpu = cpu;
+}
 
-    return result;
+// Moves a HAS_SPACE slab whose occupancy changed to the list or bucket it now belongs to
+static void kmem_partial_refile(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    int list = HAS_SPACE;
+    if (!slab->takenSlots)
+        list = EMPTY;
+    else if (!SLAB_FREE_SLOTS(slab))
+        list = FULL;
+    else if (slab->bucket == SLAB_OCCUPANCY_BUCKET(slab))
+        return;
+
+    const int cpu = slab->cpu;
+    kmem_slab_detach(cache, slab);
+    kmem_slab_attach(cache, slab, list, cpu);
 }
 
-static void *slab_allocate_empty(kmem_slab_t *pSlab[], CRESULT *retCode)
+// Frees EMPTY slabs of all caches, least recently refilled first, then asks registered shrinkers.
+// Buffers in the caller's thread lists go back first and other threads drain theirs on their next
+// kmalloc or kfree. Shrinking flushes CPU slabs, so slabs emptied by that are freed too, the
+// requester's included. Caches locked by someone else are skipped. Called with no cache lock held,
+// so shrinkers may free objects into any cache, the requester included.
+static size_t kmem_reclaim(size_t pagesWanted)
 {
-    if (!pSlab || !pSlab[EMPTY])
-        return NULL;
+    size_t recovered = 0;
+    kmem_shrinker_entry_t shrinkers[KMEM_MAX_SHRINKERS];
+    if (!s_cacheHead)
+        return 0;
+
+    kmem_thread_cache_reclaim();
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    s_reclaimStats.passes++;
+    const uint64_t pass = ++s_reclaimPass;
+    while (recovered < pagesWanted)
+    {
+        kmem_cache_t *lru = NULL;
+        for (kmem_cache_t *curr = s_cacheChain; curr; curr = curr->next)
+        {
+            if (curr->reclaimPass != pass && (!lru || curr->lastUsed < lru->lastUsed))
+                lru = curr;
+        }
+        if (!lru)
+            break;
+
+        lru->reclaimPass = pass;
+        if (!LOCK_TRY_ENTER(&lru->CriticalSection))
+            continue;
+        recovered += kmem_cache_shrink_locked(lru);
+        LOCK_LEAVE(&lru->CriticalSection);
+    }
+    memcpy(shrinkers, s_shrinkers, sizeof(shrinkers));
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
 
-    if (pSlab[EMPTY])
+    // Shrinkers run without any allocator lock, they may free objects back to caches
+    for (int i = 0; i < KMEM_MAX_SHRINKERS && recovered < pagesWanted; i++)
     {
-        kmem_slab_t *slab = pSlab[EMPTY];
-        slab_list_delete(&pSlab[EMPTY], slab);
-        slab_list_insert(&pSlab[HAS_SPACE], slab);
+        if (shrinkers[i].shrink)
+            recovered += shrinkers[i].shrink(shrinkers[i].context, pagesWanted - recovered);
     }
 
-    return slab_allocate_has_space(pSlab, retCode);
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    s_reclaimStats.pagesRecovered += recovered;
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    return recovered;
 }
 
-static void *slab_allocate_object(kmem_slab_t *pSlab[], size_t objSize, function constructor, size_t *l1CacheOffset,
-                                  CRESULT *retCode)
+// Owner is set before the mark, so lookups under the buddy lock see a marked slab with its owner
+static void kmem_slab_adopt(kmem_cache_t *cache, kmem_slab_t *slab)
 {
-    void *result = NULL;
-    if (pSlab[HAS_SPACE])
-    {
-        result = slab_allocate_has_space(pSlab, retCode);
-    }
-    else if (pSlab[EMPTY])
+    slab->cache = cache;
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    buddy_set_mark(slab, KMEM_SLAB_MARK);
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+}
+
+// Slab holding objp and its owner, NULL when objp is not inside a slab. Tags are read under the buddy
+// lock and only a marked allocation is read as a slab header. The lock keeps the slab from going back
+// to buddy during the lookup, afterwards the slab stays alive only while its owner's lock is held
+kmem_slab_t *kmem_slab_lookup(const void *objp, kmem_cache_t **owner)
+{
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    kmem_slab_t *slab = buddy_block_start(objp);
+    if (slab && ((const void *)slab == objp || buddy_get_mark(slab) != KMEM_SLAB_MARK))
+        slab = NULL;
+    *owner = slab ? slab->cache : NULL;
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+    return slab;
+}
+
+// Gives a CPU a new active slab, node wide lists are used only here
+static kmem_slab_t *kmem_cpu_refill(kmem_cache_t *cache, int cpu, CRESULT *retCode)
+{
+    cache->lastUsed = ++s_kmemClock;
+
+    kmem_slab_t *slab = cache->cpuSlab[cpu].pPartial;
+    if (!slab)
+        slab = cache->pSlab[HAS_SPACE];
+    if (!slab)
+        slab = cache->pSlab[EMPTY];
+
+    if (slab)
     {
-        result = slab_allocate_empty(pSlab, retCode);
+        kmem_slab_detach(cache, slab);
     }
     else
     {
-        kmem_slab_t *slab;
-        CRESULT code = get_slab(objSize, l1CacheOffset, &slab);
+        // Out of memory is reclaimed by kmem_cache_alloc_reclaim once the cache lock is dropped
+        CRESULT code = get_slab_layout(&cache->layout, &slab);
         if (code != OK)
         {
             *retCode |= code;
             return NULL;
         }
+        kmem_slab_adopt(cache, slab);
+    }
+
+    kmem_slab_attach(cache, slab, CPU_ACTIVE, cpu);
+    return slab;
+}
 
-        slab_list_insert(&pSlab[HAS_SPACE], slab);
-        result = slab_allocate_has_space(pSlab, retCode);
+// Moves all CPU owned slabs back to node wide lists
+static void kmem_cpu_flush(kmem_cache_t *cache)
+{
+    for (int cpu = 0; cpu < KMEM_MAX_CPUS; cpu++)
+    {
+        kmem_cpu_slab_t *cpuSlab = &cache->cpuSlab[cpu];
+        while (cpuSlab->pPartial || cpuSlab->pActive)
+        {
+            kmem_slab_t *slab = cpuSlab->pPartial ? cpuSlab->pPartial : cpuSlab->pActive;
+            kmem_slab_detach(cache, slab);
+            kmem_slab_attach(cache, slab,
+                             !slab->takenSlots ? EMPTY
+                                               : (!SLAB_FREE_SLOTS(slab) ? FULL : HAS_SPACE),
+                             0);
+        }
     }
+}
 
-    if (constructor)
+static void *slab_allocate_object(kmem_cache_t *cache, bool zero, CRESULT *retCode)
+{
+    const int cpu = kmem_current_cpu();
+    kmem_slab_t *slab = cache->cpuSlab[cpu].pActive;
+    if (!slab)
     {
-        constructor(result);
+        slab = kmem_cpu_refill(cache, cpu, retCode);
+        if (!slab)
+            return NULL;
+    }
+
+    // Frontier slots are handed out first, in a zeroed slab they were never written
+    const bool knownZero = slab->zeroed && (size_t)slab->frontier < NUMBER_OF_OBJECTS_IN_SLAB(slab);
+    void *result;
+    CRESULT code = slab_allocate(slab, &result);
+    if (code != OK)
+    {
+        *retCode |= code;
+        ASSERT(0 && "allocate failed");
+        return NULL;
+    }
+    if (zero && !knownZero)
+    {
+        memset(result, 0, cache->objectSize);
+    }
+
+    if (!SLAB_FREE_SLOTS(slab))
+    {
+        kmem_slab_full(cache, slab, cpu);
+    }
+
+    if (cache->constructor)
+    {
+        cache->constructor(result);
     }
 
     return result;
 }
 
-void *kmalloc(size_t size)
+// Allocates under the cache lock. Caller must not hold it, when buddy is out of memory the lock is
+// dropped while memory is reclaimed and the allocation is retried against the current CPU slab
+static void *kmem_cache_alloc_reclaim(kmem_cache_t *cache, bool zero, CRESULT *retCode)
+{
+    CRESULT code = OK;
+    LOCK_ENTER(&cache->CriticalSection);
+    void *ret = slab_allocate_object(cache, zero, &code);
+    if (ret || code != NOT_ENOUGH_MEMORY)
+        *retCode |= code;
+    LOCK_LEAVE(&cache->CriticalSection);
+    if (ret || code != NOT_ENOUGH_MEMORY)
+        return ret;
+
+    // Retried even when no pages came back, drained thread lists and CPU slabs may have made room
+    kmem_reclaim(cache->layout.slabSize / BLOCK_SIZE);
+    code = OK;
+    LOCK_ENTER(&cache->CriticalSection);
+    ret = slab_allocate_object(cache, zero, &code);
+    *retCode |= code;
+    LOCK_LEAVE(&cache->CriticalSection);
+
+    if (code == NOT_ENOUGH_MEMORY && s_cacheHead)
+    {
+        LOCK_ENTER(&s_cacheHead->CriticalSection);
+        s_reclaimStats.failures++;
+        LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    }
+    return ret;
+}
+
+// Above the largest size class memory comes straight from buddy as a run of whole blocks
+static void *kmalloc_large(size_t size)
+{
+    void *ret;
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    CRESULT code = buddy_alloc_large(size, &ret);
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+    return code == OK ? ret : NULL;
+}
+
+static void *kmem_buffer_class_alloc(int index, bool zero)
+{
+    // Zeroed buffers take the locked path, it knows which slots were never written
+    if (!zero)
+    {
+        void *ret = kmem_thread_alloc(index);
+        if (ret)
+            return ret;
+    }
+
+    CRESULT code = OK;
+    return kmem_cache_alloc_reclaim(&s_bufferHead[index], zero, &code);
+}
+
+static void *kmem_buffer_alloc(size_t size, bool zero)
 {
     if (!s_bufferHead)
         return NULL;
-    const int entryId = BEST_FIT_BLOCKID(size) - 5;
-    if (entryId < BUFFER_SIZE_MIN - 5 || entryId > BUFFER_SIZE_MAX - 5)
-        return NULL;
+    const int entryId = kmalloc_index(size);
+    if (entryId < 0)
+    {
+        void *ret = size ? kmalloc_large(size) : NULL;
+        if (ret && zero && !buddy_is_zeroed(ret, size))
+            memset(ret, 0, size);
+        return ret;
+    }
+    return kmem_buffer_class_alloc(entryId, zero);
+}
+
+// Takes up to count objects of class index under one lock and links them in front of *head
+// through their first word. Returns how many were taken
+int kmem_buffer_alloc_bulk(int index, int count, void **head)
+{
+    kmem_buffer_t *buffer = &s_bufferHead[index];
     CRESULT code = OK;
-    EnterCriticalSection(&s_bufferHead[entryId].CriticalSection);
-    void *ret = slab_allocate_object(s_bufferHead[entryId].pSlab, 1 << BEST_FIT_BLOCKID(size), NULL,
-                                     &s_bufferHead[entryId].l1CacheFiller, &code);
-    LeaveCriticalSection(&s_bufferHead[entryId].CriticalSection);
-    return ret;
+    int taken = 0;
+
+    LOCK_ENTER(&buffer->CriticalSection);
+    for (; taken < count; taken++)
+    {
+        void *obj = slab_allocate_object(buffer, false, &code);
+        if (!obj)
+            break;
+        *(void **)obj = *head;
+        *head = obj;
+    }
+    LOCK_LEAVE(&buffer->CriticalSection);
+
+    return taken;
+}
+
+void *kmalloc_generic(size_t size)
+{
+    return kmem_buffer_alloc(size, false);
+}
+
+void *kmalloc_class(int index)
+{
+    if (!s_bufferHead || index < 0 || index >= BUFFER_ENTRY_NUM)
+        return NULL;
+    return kmem_buffer_class_alloc(index, false);
+}
+
+void *kzalloc(size_t size)
+{
+    return kmem_buffer_alloc(size, true);
+}
+
+// Slab of the object if it belongs to cache. Caller holds the cache lock, which keeps the slab alive
+static CRESULT kmem_cache_find_slab(kmem_cache_t *cache, const void *objp, kmem_slab_t **result)
+{
+    kmem_cache_t *owner;
+    kmem_slab_t *slab = kmem_slab_lookup(objp, &owner);
+    if (!slab || owner != cache)
+        return FAIL;
+
+    *result = slab;
+    return OK;
 }
 
-static CRESULT slab_kfree_object(kmem_slab_t *pSlab[], void *objp, function destructor)
+static CRESULT slab_kfree_object(kmem_cache_t *cache, void *objp)
 {
     kmem_slab_t *slab;
-    CRESULT code = slab_find_slab_with_obj(pSlab[FULL], objp, &slab);
+    if (kmem_cache_find_slab(cache, objp, &slab) != OK)
+        return FAIL;
+    // Interior pointers and objects already free never reach the destructor
+    if (!slab_slot_allocated(slab, objp))
+        return SLAB_DEALLOC_NOT_VALID_ADDRES;
 
-    if (code == OK)
+    if (cache->destructor)
     {
-        if (destructor)
-        {
-            destructor(objp);
-        }
-        code = slab_free(slab, objp);
-        ASSERT(code == OK);
-        slab_list_delete(&pSlab[FULL], slab);
+        cache->destructor(objp);
     }
-    else
+    slab_free(slab, objp);
+
+    // Object always goes back to the slab it came from, whichever CPU frees it
+    if (slab->list != CPU_ACTIVE)
+        kmem_slab_freed(cache, slab);
+
+    return OK;
+}
+
+void kmem_slab_full(kmem_cache_t *cache, kmem_slab_t *slab, int cpu)
+{
+    kmem_slab_detach(cache, slab);
+    kmem_slab_attach(cache, slab, FULL, cpu);
+}
+
+void kmem_slab_freed(kmem_cache_t *cache, kmem_slab_t *slab)
+{
+    if (!slab->takenSlots)
     {
-        code = slab_find_slab_with_obj(pSlab[HAS_SPACE], objp, &slab);
-        if (code != OK)
+        kmem_slab_detach(cache, slab);
+        kmem_slab_attach(cache, slab, EMPTY, 0);
+    }
+    else if (slab->list == FULL)
+    {
+        const int cpu = slab->cpu;
+        kmem_slab_detach(cache, slab);
+        kmem_slab_attach(cache, slab, cache->cpuSlab[cpu].numPartial < KMEM_CPU_PARTIAL_MAX ? CPU_PARTIAL : HAS_SPACE,
+                         cpu);
+    }
+    else if (slab->list == HAS_SPACE)
+    {
+        kmem_partial_refile(cache, slab);
+    }
+}
+
+static void kmem_buffer_shrink_eager(kmem_buffer_t *buffer)
+{
+    // The background reclaimer does this off the caller's thread when running
+    if (!s_reclaimer.running)
+    {
+        slab_deallocate_list(&buffer->pSlab[EMPTY]);
+        buffer->pEmptyTail = NULL;
+    }
+}
+
+// Frees a NULL terminated chain of class index objects linked through their first word
+void kmem_buffer_free_bulk(int index, void *head)
+{
+    kmem_buffer_t *buffer = &s_bufferHead[index];
+
+    LOCK_ENTER(&buffer->CriticalSection);
+    while (head)
+    {
+        void *next = *(void **)head;
+        const CRESULT code = slab_kfree_object(buffer, head);
+        ASSERT(code == OK); // Chains hold only objects taken by kmem_buffer_alloc_bulk
+        (void)code;
+        head = next;
+    }
+    kmem_buffer_shrink_eager(buffer);
+    LOCK_LEAVE(&buffer->CriticalSection);
+}
+
+// Large kmalloc buffers are buddy allocation heads without the slab mark. Caller holds the buddy lock
+static bool kmem_large_buffer(const void *objp)
+{
+    return buddy_block_start(objp) == objp && buddy_get_mark(objp) != KMEM_SLAB_MARK;
+}
+
+// Frees count kfree pointers with the checks of kfree. Owner classes are looked up under the buddy
+// lock, then each class is locked once and its objects are looked up and slot checked again under
+// it, so a pointer freed twice, an interior pointer or an object of another cache is refused however
+// the frees race. Large buffers are freed in the first pass, anything else is ignored
+void kmem_buffer_free_checked(const void *const *ptrs, int count)
+{
+    int entry[KMEM_THREAD_FREE_MAX]; // Owner class of each pointer, -1 once done
+    ASSERT(count <= KMEM_THREAD_FREE_MAX);
+
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    for (int i = 0; i < count; i++)
+    {
+        kmem_cache_t *owner;
+        entry[i] = -1;
+        if (kmem_slab_lookup(ptrs[i], &owner))
         {
-            return FAIL;
+            if (owner >= s_bufferHead && owner < s_bufferHead + BUFFER_ENTRY_NUM)
+                entry[i] = (int)(owner - s_bufferHead);
         }
-
-        if (destructor)
+        else if (kmem_large_buffer(ptrs[i]))
         {
-            destructor(objp);
+            buddy_free((void *)ptrs[i]);
         }
-        code = slab_free(slab, objp);
-        slab_list_delete(&pSlab[HAS_SPACE], slab);
     }
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
 
-    slab_list_insert(&pSlab[(slab->takenSlots ? HAS_SPACE : EMPTY)], slab);
-    return OK;
+    for (int i = 0; i < count; i++)
+    {
+        if (entry[i] < 0)
+            continue;
+
+        const int index = entry[i];
+        kmem_buffer_t *buffer = &s_bufferHead[index];
+        LOCK_ENTER(&buffer->CriticalSection);
+        for (int j = i; j < count; j++)
+        {
+            if (entry[j] != index)
+                continue;
+            entry[j] = -1;
+            slab_kfree_object(buffer, (void *)ptrs[j]);
+        }
+        kmem_buffer_shrink_eager(buffer);
+        LOCK_LEAVE(&buffer->CriticalSection);
+    }
 }
 
 void kfree(const void *objp)
@@ -193,17 +655,56 @@ void kfree(const void *objp)
     if (!objp || !s_bufferHead)
         return;
 
-    for (int i = 0; i < BUFFER_ENTRY_NUM; i++)
+    // Thread cache only records the pointer, checks run when its batch goes back. Large buffers start
+    // a block, block aligned pointers are freed right away so large buffers never wait
+    if ((size_t)objp % BLOCK_SIZE == 0 || !kmem_thread_free(objp))
+        kmem_buffer_free_checked(&objp, 1);
+}
+
+size_t ksize(const void *objp)
+{
+    if (!objp || !s_bufferHead)
+        return 0;
+
+    // Slab header is read under the buddy lock and only when the allocation is marked as a slab
+    size_t size = 0;
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    const kmem_slab_t *slab = buddy_block_start(objp);
+    if (slab && (const void *)slab != objp && buddy_get_mark(slab) == KMEM_SLAB_MARK)
+        size = slab->objectSize;
+    else if (kmem_large_buffer(objp))
+        size = buddy_usable_size(objp);
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+    return size;
+}
+
+void *krealloc(const void *objp, size_t size)
+{
+    if (!objp)
+        return kmalloc(size);
+    if (!size)
     {
-        EnterCriticalSection(&s_bufferHead[i].CriticalSection);
-        CRESULT code = slab_kfree_object(s_bufferHead[i].pSlab, objp, NULL);
-        int ret = slab_deallocate_list(&s_bufferHead[i].pSlab[EMPTY]); // kmem_shrink
-        LeaveCriticalSection(&s_bufferHead[i].CriticalSection);
-        if (code == OK)
-            return;
+        kfree(objp);
+        return NULL;
     }
 
-    ASSERT(false && "Not Reached");
+    const size_t oldSize = ksize(objp);
+    if (size <= oldSize)
+        return (void *)objp;
+
+    // Large buffer first tries to take the free blocks after it
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    const CRESULT code = kmem_large_buffer(objp) ? buddy_extend((void *)objp, size) : FAIL;
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+    if (code == OK)
+        return (void *)objp;
+
+    void *ret = kmalloc(size);
+    if (!ret)
+        return NULL;
+    memcpy(ret, objp, oldSize);
+    kfree(objp);
+    return ret;
 }
 
 void *kmem_cache_alloc(kmem_cache_t *cachep)
@@ -211,11 +712,84 @@ void *kmem_cache_alloc(kmem_cache_t *cachep)
     if (!cachep)
         return NULL;
 
-    EnterCriticalSection(&cachep->CriticalSection);
-    void *ret = slab_allocate_object(cachep->pSlab, cachep->objectSize, cachep->constructor, &cachep->l1CacheFiller,
-                                     &cachep->errorFlags);
-    LeaveCriticalSection(&cachep->CriticalSection);
-    return ret;
+    return kmem_cache_alloc_reclaim(cachep, false, &cachep->errorFlags);
+}
+
+// Object is zeroed before the constructor runs
+void *kmem_cache_zalloc(kmem_cache_t *cachep)
+{
+    if (!cachep)
+        return NULL;
+
+    return kmem_cache_alloc_reclaim(cachep, true, &cachep->errorFlags);
+}
+
+// Allocates from a slab off the CPU fast path and moves the slab if it filled up
+static void *kmem_slab_alloc_from(kmem_cache_t *cache, kmem_slab_t *slab, CRESULT *retCode)
+{
+    void *result;
+    CRESULT code = slab_allocate(slab, &result);
+    if (code != OK)
+    {
+        *retCode |= code;
+        return NULL;
+    }
+
+    if (slab->list == HAS_SPACE)
+    {
+        kmem_partial_refile(cache, slab);
+    }
+    else if (!SLAB_FREE_SLOTS(slab))
+    {
+        const int cpu = slab->cpu;
+        kmem_slab_detach(cache, slab);
+        kmem_slab_attach(cache, slab, FULL, cpu);
+    }
+
+    if (cache->constructor)
+    {
+        cache->constructor(result);
+    }
+    return result;
+}
+
+// Slab of near if it is this cache's and has room, else a partial slab in the same huge page region.
+// A near of another cache, a large buffer or freed memory only picks the region. Caller holds the
+// cache lock, so a slab found to be this cache's stays alive
+static kmem_slab_t *kmem_hint_slab(kmem_cache_t *cache, const void *near)
+{
+    kmem_cache_t *owner;
+    kmem_slab_t *slab = kmem_slab_lookup(near, &owner);
+    if (slab && owner == cache && SLAB_FREE_SLOTS(slab))
+        return slab;
+
+    const size_t region = (size_t)near / HUGE_PAGE_SIZE;
+    kmem_slab_t *curr = cache->cpuSlab[kmem_current_cpu()].pPartial;
+    for (; curr; curr = curr->next)
+    {
+        if ((size_t)curr / HUGE_PAGE_SIZE == region)
+            return curr;
+    }
+
+    int scanned = 0;
+    for (curr = cache->pSlab[HAS_SPACE]; curr && scanned < KMEM_HINT_SCAN; curr = curr->next, scanned++)
+    {
+        if ((size_t)curr / HUGE_PAGE_SIZE == region)
+            return curr;
+    }
+    return NULL;
+}
+
+void *kmem_cache_alloc_hint(kmem_cache_t *cachep, const void *near)
+{
+    if (!cachep)
+        return NULL;
+
+    LOCK_ENTER(&cachep->CriticalSection);
+    kmem_slab_t *slab = near ? kmem_hint_slab(cachep, near) : NULL;
+    void *ret = slab ? kmem_slab_alloc_from(cachep, slab, &cachep->errorFlags) : NULL;
+    LOCK_LEAVE(&cachep->CriticalSection);
+    return slab ? ret : kmem_cache_alloc_reclaim(cachep, false, &cachep->errorFlags);
 }
 
 void kmem_cache_free(kmem_cache_t *cachep, void *objp)
@@ -223,13 +797,13 @@ void kmem_cache_free(kmem_cache_t *cachep, void *objp)
     if (!cachep || !objp)
         return;
 
-    EnterCriticalSection(&cachep->CriticalSection);
-    cachep->errorFlags = slab_kfree_object(cachep->pSlab, objp, cachep->destructor);
-    LeaveCriticalSection(&cachep->CriticalSection);
+    LOCK_ENTER(&cachep->CriticalSection);
+    cachep->errorFlags = slab_kfree_object(cachep, objp);
+    LOCK_LEAVE(&cachep->CriticalSection);
 }
 
-static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name, size_t size, void (*ctor)(void *),
-                                         void (*dtor)(void *))
+static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name, size_t size, size_t align,
+                                         enum Slab_Color colorMode, void (*ctor)(void *), void (*dtor)(void *))
 {
     if (!cache)
         return;
@@ -237,13 +811,18 @@ static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name,
     cache->destructor = dtor;
     cache->objectSize = size;
     cache->errorFlags = OK;
+    cache->lastUsed = 0;
+    cache->reclaimPass = 0;
     strncpy_s(cache->name, NAME_MAX_LEN - 1, name, NAME_MAX_LEN - 1);
-    cache->l1CacheFiller = 0;
+    slab_layout_init(&cache->layout, size, align, colorMode);
     cache->pSlab[EMPTY] = NULL;
+    cache->pEmptyTail = NULL;
     cache->pSlab[HAS_SPACE] = NULL;
+    kmem_partial_reset(cache);
     cache->pSlab[FULL] = NULL;
+    memset(cache->cpuSlab, 0, sizeof(cache->cpuSlab));
 
-    if (!InitializeCriticalSectionAndSpinCount(&cache->CriticalSection, 0x1))
+    if (!LOCK_INIT(&cache->CriticalSection, 0x1))
     {
         ASSERT(false);
     }
@@ -251,19 +830,42 @@ static void kmem_create_cache_init_state(kmem_cache_t *cache, const char *name,
 
 kmem_cache_t *kmem_cache_create(const char *name, size_t size, void (*ctor)(void *), void (*dtor)(void *))
 {
-    if (!size || !name)
+    return kmem_cache_create_aligned(name, size, 0, 0, ctor, dtor);
+}
+
+kmem_cache_t *kmem_cache_create_aligned(const char *name, size_t size, size_t align, unsigned flags,
+                                        void (*ctor)(void *), void (*dtor)(void *))
+{
+    if (!size || !name || (align && !POWER_OF_TWO(align)))
         return NULL;
 
-    EnterCriticalSection(&s_cacheHead->CriticalSection);
-    s_cacheHead->errorFlags = OK;
-    kmem_cache_t *newCache = kmem_cache_alloc(s_cacheHead);
-    if (s_cacheHead->errorFlags != OK)
+    if (flags & SLAB_HWCACHE_ALIGN)
+    {
+        size_t lineAlign = CACHE_L1_LINE_SIZE;
+        while (size <= lineAlign / 2)
+            lineAlign /= 2;
+        if (lineAlign > align)
+            align = lineAlign;
+    }
+
+    // Allocated before taking the chain lock, reclaim must run with no allocator lock held
+    CRESULT code = OK;
+    kmem_cache_t *newCache = kmem_cache_alloc_reclaim(s_cacheHead, false, &code);
+
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    s_cacheHead->errorFlags = code;
+    if (code != OK)
     {
-        LeaveCriticalSection(&s_cacheHead->CriticalSection);
+        LOCK_LEAVE(&s_cacheHead->CriticalSection);
         return NULL;
     }
-    kmem_create_cache_init_state(newCache, name, size, ctor, dtor);
-    LeaveCriticalSection(&s_cacheHead->CriticalSection);
+    const enum Slab_Color colorMode = flags & SLAB_NO_COLOR ? SLAB_COLOR_NONE
+                                      : flags & SLAB_L2_COLOR ? SLAB_COLOR_L2
+                                                              : SLAB_COLOR_L1;
+    kmem_create_cache_init_state(newCache, name, size, align, colorMode, ctor, dtor);
+    kmem_cache_chain_add(newCache);
+    TRACE(CACHE_CREATE, newCache, size);
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
 
     return newCache;
 }
@@ -293,31 +895,129 @@ void kmem_cache_destroy(kmem_cache_t *cachep)
     if (!cachep)
         return;
 
-    EnterCriticalSection(&cachep->CriticalSection);
+    TRACE(CACHE_DESTROY, cachep, cachep->objectSize);
+
+    // Off the chain first, so reclaim can't reach a cache whose lock is being deleted
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    kmem_cache_chain_remove(cachep);
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+
+    LOCK_ENTER(&cachep->CriticalSection);
+    kmem_cpu_flush(cachep);
     for (enum Slab_Type status = EMPTY; status <= FULL; status++)
     {
         slab_deallocate_list(&cachep->pSlab[status]);
     }
-    LeaveCriticalSection(&cachep->CriticalSection);
+    cachep->pEmptyTail = NULL;
+    kmem_partial_reset(cachep);
+    LOCK_LEAVE(&cachep->CriticalSection);
 
-    DeleteCriticalSection(&cachep->CriticalSection);
+    LOCK_DELETE(&cachep->CriticalSection);
 
     s_cacheHead->errorFlags = OK;
 
-    EnterCriticalSection(&s_cacheHead->CriticalSection);
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
     kmem_cache_free(s_cacheHead, cachep);
-    kmem_cache_shrink(s_cacheHead);
-    LeaveCriticalSection(&s_cacheHead->CriticalSection);
+    kmem_cache_shrink_locked(s_cacheHead);
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+}
+
+// Caller holds the cache lock
+static int kmem_cache_shrink_locked(kmem_cache_t *cache)
+{
+    kmem_cpu_flush(cache);
+    int ret = slab_deallocate_list(&cache->pSlab[EMPTY]);
+    cache->pEmptyTail = NULL;
+    return ret;
 }
 
 int kmem_cache_shrink(kmem_cache_t *cachep)
 {
-    EnterCriticalSection(&cachep->CriticalSection);
-    int ret = slab_deallocate_list(&cachep->pSlab[EMPTY]);
-    LeaveCriticalSection(&cachep->CriticalSection);
+    LOCK_ENTER(&cachep->CriticalSection);
+    int ret = kmem_cache_shrink_locked(cachep);
+    LOCK_LEAVE(&cachep->CriticalSection);
     return ret;
 }
 
+// Objects move without ctor or dtor and move runs under the cache lock, so it must not use this cache.
+// A slab is emptied only when the other HAS_SPACE slabs can take all of its objects.
+int kmem_cache_defrag(kmem_cache_t *cachep, kmem_move_t move)
+{
+    if (!cachep || !move)
+        return 0;
+
+    int freed = 0;
+    kmem_slab_t *pinned = NULL;
+    LOCK_ENTER(&cachep->CriticalSection);
+    kmem_cpu_flush(cachep);
+
+    size_t freeSlots = 0;
+    for (kmem_slab_t *curr = cachep->pSlab[HAS_SPACE]; curr; curr = curr->next)
+        freeSlots += SLAB_FREE_SLOTS(curr);
+
+    kmem_slab_t *victim;
+    bool stuck = false;
+    while (!stuck && (victim = cachep->pPartialTail) && victim != cachep->pSlab[HAS_SPACE] &&
+           freeSlots - SLAB_FREE_SLOTS(victim) >= victim->takenSlots)
+    {
+        kmem_slab_detach(cachep, victim);
+        freeSlots -= SLAB_FREE_SLOTS(victim);
+
+        int id = 0;
+        void *objp;
+        while ((objp = slab_next_object(victim, &id)))
+        {
+            // Objects left when no slab can take them stay in place and pin the victim
+            kmem_slab_t *dest = cachep->pSlab[HAS_SPACE];
+            void *newp;
+            if (slab_allocate(dest, &newp) != OK)
+            {
+                stuck = true;
+                break;
+            }
+            if (move(objp, newp))
+            {
+                slab_free(victim, objp);
+                freeSlots--;
+                kmem_partial_refile(cachep, dest);
+            }
+            else
+            {
+                slab_free(dest, newp);
+            }
+        }
+
+        if (victim->takenSlots)
+        {
+            slab_list_insert(&pinned, victim);
+            continue;
+        }
+        delete_slab(victim);
+        freed++;
+    }
+
+    while (pinned)
+    {
+        victim = pinned;
+        slab_list_delete(&pinned, victim);
+        kmem_slab_attach(cachep, victim, HAS_SPACE, 0);
+    }
+    LOCK_LEAVE(&cachep->CriticalSection);
+    return freed;
+}
+
+static void kmem_cache_info_list(kmem_slab_t *head, int *number_slabs, int *number_blocks, int *maxObjects,
+                                 int *number_objects_free)
+{
+    for (kmem_slab_t *curr = head; curr; curr = curr->next)
+    {
+        (*number_slabs)++;
+        *number_blocks += curr->slabSize / BLOCK_SIZE;
+        *maxObjects += NUMBER_OF_OBJECTS_IN_SLAB(curr);
+        *number_objects_free += SLAB_FREE_SLOTS(curr);
+    }
+}
+
 void kmem_cache_info(kmem_cache_t *cachep)
 {
     int number_slabs = 0;
@@ -325,26 +1025,214 @@ void kmem_cache_info(kmem_cache_t *cachep)
     int number_objects_free = 0;
     int maxObjects = 0;
 
-    EnterCriticalSection(&cachep->CriticalSection);
+    LOCK_ENTER(&cachep->CriticalSection);
     for (enum Slab_Type status = EMPTY; status <= FULL; status++)
-        for (kmem_slab_t *curr = cachep->pSlab[status]; curr; curr = curr->next)
-        {
-            number_slabs++;
-            number_blocks += curr->slabSize / BLOCK_SIZE;
-            maxObjects += NUMBER_OF_OBJECTS_IN_SLAB(curr);
-            for (int i = 0; i < curr->numBitMapEntry; i++)
-            {
-                int n = 1 << sizeof(BitMapEntry) * CHAR_BIT;
-                BitMapEntry num = curr->pBitmap[i];
-                while (n)
-                {
-                    number_objects_free += num & 1;
-                    num >>= 1;
-                    n >>= 1;
-                }
-            }
-        }
-    LeaveCriticalSection(&cachep->CriticalSection);
+        kmem_cache_info_list(cachep->pSlab[status], &number_slabs, &number_blocks, &maxObjects, &number_objects_free);
+    for (int cpu = 0; cpu < KMEM_MAX_CPUS; cpu++)
+    {
+        kmem_cache_info_list(cachep->cpuSlab[cpu].pActive, &number_slabs, &number_blocks, &maxObjects,
+                             &number_objects_free);
+        kmem_cache_info_list(cachep->cpuSlab[cpu].pPartial, &number_slabs, &number_blocks, &maxObjects,
+                             &number_objects_free);
+    }
+    LOCK_LEAVE(&cachep->CriticalSection);
     printf_s("Cache info\nName: %s\nObject size: %llu\nNum blocks: %d\nNumber slabs: %d\nNumber objects: %d\nPercentage: %f\n",
         cachep->name, (unsigned long long)cachep->objectSize, number_blocks, number_slabs, maxObjects - number_objects_free, ((double)maxObjects - number_objects_free) / maxObjects);
 }
+
+int kmem_cache_lock_stats(kmem_cache_t *cachep, kmem_lock_stats_t *stats)
+{
+    if (!cachep || !stats)
+        return PARAM_ERROR;
+
+    return LOCK_STATS_GET(&cachep->CriticalSection, stats);
+}
+
+int kmem_lock_stats(const char *name, kmem_lock_stats_t *stats)
+{
+    if (!name || !stats || !s_cacheHead)
+        return PARAM_ERROR;
+
+    if (!strcmp(name, "buddy"))
+        return LOCK_STATS_GET(&s_pBuddyHead->CriticalSection, stats);
+
+    int code = FAIL;
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    for (kmem_cache_t *curr = s_cacheChain; curr; curr = curr->next)
+    {
+        if (!strcmp(curr->name, name))
+        {
+            code = LOCK_STATS_GET(&curr->CriticalSection, stats);
+            break;
+        }
+    }
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    return code;
+}
+
+static void kmem_lock_stats_print_one(const char *name, const kmem_lock_stats_t *stats, double nsPerTick)
+{
+    printf_s("%-*s %12llu %12llu %14.0f %14.0f %14.0f %14.0f\n", NAME_MAX_LEN, name,
+             (unsigned long long)stats->acquisitions, (unsigned long long)stats->contended,
+             stats->waitTotal * nsPerTick, stats->waitMax * nsPerTick, stats->holdTotal * nsPerTick,
+             stats->holdMax * nsPerTick);
+}
+
+void kmem_lock_stats_print()
+{
+    if (!s_cacheHead)
+        return;
+
+    const double nsPerTick = 1e9 / read_timestamp_frequency();
+    kmem_lock_stats_t stats = {0};
+
+    printf_s("Lock stats\n%-*s %12s %12s %14s %14s %14s %14s\n", NAME_MAX_LEN, "Name", "Acquired", "Contended",
+             "Wait ns", "Max wait ns", "Hold ns", "Max hold ns");
+    if (kmem_lock_stats("buddy", &stats) == OK)
+    {
+        kmem_lock_stats_print_one("buddy", &stats, nsPerTick);
+    }
+
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    for (kmem_cache_t *curr = s_cacheChain; curr; curr = curr->next)
+    {
+        if (LOCK_STATS_GET(&curr->CriticalSection, &stats) == OK)
+        {
+            kmem_lock_stats_print_one(curr->name, &stats, nsPerTick);
+        }
+    }
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+}
+
+int kmem_register_shrinker(kmem_shrinker_t shrink, void *context)
+{
+    if (!shrink || !s_cacheHead)
+        return PARAM_ERROR;
+
+    int code = NOT_ENOUGH_MEMORY;
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    for (int i = 0; i < KMEM_MAX_SHRINKERS; i++)
+    {
+        if (!s_shrinkers[i].shrink)
+        {
+            s_shrinkers[i].shrink = shrink;
+            s_shrinkers[i].context = context;
+            code = OK;
+            break;
+        }
+    }
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    return code;
+}
+
+int kmem_unregister_shrinker(kmem_shrinker_t shrink, void *context)
+{
+    if (!shrink || !s_cacheHead)
+        return PARAM_ERROR;
+
+    int code = FAIL;
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    for (int i = 0; i < KMEM_MAX_SHRINKERS; i++)
+    {
+        if (s_shrinkers[i].shrink == shrink && s_shrinkers[i].context == context)
+        {
+            s_shrinkers[i].shrink = NULL;
+            s_shrinkers[i].context = NULL;
+            code = OK;
+            break;
+        }
+    }
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    return code;
+}
+
+void kmem_reclaim_stats(kmem_reclaim_stats_t *stats)
+{
+    if (!stats || !s_cacheHead)
+        return;
+
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    *stats = s_reclaimStats;
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+}
+
+// Releases up to batch EMPTY slabs idle for at least idlePasses, oldest first
+static int kmem_reclaimer_release(kmem_cache_t *cache, uint32_t pass)
+{
+    int released = 0;
+    kmem_slab_t *slab = cache->pEmptyTail;
+    while (slab && released < (int)s_reclaimer.batch && pass - slab->emptySince >= s_reclaimer.idlePasses)
+    {
+        kmem_slab_t *newer = slab->prev;
+        kmem_slab_detach(cache, slab);
+        delete_slab(slab);
+        released++;
+        slab = newer;
+    }
+    return released;
+}
+
+static void kmem_reclaimer_pass()
+{
+    const uint32_t pass = ++s_reclaimer.pass;
+    int released = 0;
+
+    // Busy caches are skipped, chain lock is never held while waiting for a cache
+    LOCK_ENTER(&s_cacheHead->CriticalSection);
+    for (kmem_cache_t *curr = s_cacheChain; curr; curr = curr->next)
+    {
+        if (!curr->pEmptyTail || !LOCK_TRY_ENTER(&curr->CriticalSection))
+            continue;
+        released += kmem_reclaimer_release(curr, pass);
+        LOCK_LEAVE(&curr->CriticalSection);
+    }
+    s_reclaimStats.backgroundPasses++;
+    s_reclaimStats.backgroundSlabs += released;
+    LOCK_LEAVE(&s_cacheHead->CriticalSection);
+
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    buddy_hot_cache_drain();
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
+}
+
+static DWORD WINAPI kmem_reclaimer_main(LPVOID param)
+{
+    while (!s_reclaimer.stop)
+    {
+        Sleep(s_reclaimer.periodMs);
+        if (!s_reclaimer.stop)
+            kmem_reclaimer_pass();
+    }
+    return 0;
+}
+
+int kmem_reclaimer_start(unsigned periodMs, unsigned idlePasses, unsigned batch)
+{
+    if (!s_cacheHead || !batch)
+        return PARAM_ERROR;
+    if (s_reclaimer.running)
+        return SYSTEM_ALREADY_INITIALIZED;
+
+    s_reclaimer.periodMs = periodMs;
+    s_reclaimer.idlePasses = idlePasses;
+    s_reclaimer.batch = batch;
+    InterlockedExchange(&s_reclaimer.stop, 0);
+    s_reclaimer.thread = CreateThread(NULL, 0, kmem_reclaimer_main, NULL, 0, NULL);
+    if (!s_reclaimer.thread)
+        return FAIL;
+
+    InterlockedExchange(&s_reclaimer.running, 1);
+    return OK;
+}
+
+void kmem_reclaimer_stop()
+{
+    if (!s_reclaimer.running)
+        return;
+
+    InterlockedExchange(&s_reclaimer.stop, 1);
+    WaitForSingleObject(s_reclaimer.thread, INFINITE);
+    CloseHandle(s_reclaimer.thread);
+    s_reclaimer.thread = NULL;
+    InterlockedExchange(&s_reclaimer.running, 0);
+}
@@ -1,21 +1,22 @@
 #include "buddy/buddy.h"
 #include "error_codes.h"
 #include "slab_impl.h"
+#include "trace.h"
 
 extern buddy_allocator_t *s_pBuddyHead;
 
 static inline void setBitMap(kmem_slab_t *slab, int id, uint8_t value)
 {
     const int addr = id >> BITMAP_NUM_BITS_ENTRY_POW_2;
-    const int off = 1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1));
+    const BitMapEntry off = (BitMapEntry)1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1));
     slab->pBitmap[addr] = (value ? slab->pBitmap[addr] | off : slab->pBitmap[addr] & ~off);
 }
 
 static inline uint8_t getBitMap(kmem_slab_t *slab, int id)
 {
     const int addr = id >> BITMAP_NUM_BITS_ENTRY_POW_2;
-    const int off = 1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1));
-    return slab->pBitmap[addr] & off;
+    const BitMapEntry off = (BitMapEntry)1 << (id & ((1 << BITMAP_NUM_BITS_ENTRY_POW_2) - 1));
+    return (slab->pBitmap[addr] & off) != 0;
 }
 
 CRESULT get_slab_init_bitmap(kmem_slab_t *slab)
@@ -23,39 +24,79 @@ CRESULT get_slab_init_bitmap(kmem_slab_t *slab)
     if (!slab)
         return PARAM_ERROR;
 
-    slab->numBitMapEntry =
-        (slab->slabSize - sizeof(kmem_slab_t)) / (slab->objectSize * CHAR_BIT * sizeof(BitMapEntry)) + 1;
+    slab->numBitMapEntry = slab_bitmap_entries(slab->slabSize, slab->objectSize);
     slab->pBitmap = slab->memStart;
     slab->memStart = (void *)((size_t)slab->memStart + slab->numBitMapEntry * sizeof(BitMapEntry));
 
-    for (int i = 0; i < slab->numBitMapEntry; i++)
-    {
-        slab->pBitmap[i] = 0;
-    }
+    // Bitmap holds only freed slots below the frontier, entries are cleared as the frontier reaches them
+    slab->frontier = 0;
 
     return OK;
 }
 
-CRESULT get_slab(size_t objectSize, size_t *l1CacheOffset, kmem_slab_t **result)
+size_t slab_bitmap_entries(size_t slabSize, size_t objectSize)
 {
-    if (objectSize == 0 || !result || !l1CacheOffset)
-    {
-        *result = NULL;
+    // Every object takes objectSize bytes and one bit, so tiny objects don't get an oversized bitmap
+    const size_t bitsPerEntry = CHAR_BIT * sizeof(BitMapEntry);
+    const size_t numObjects = (slabSize - sizeof(kmem_slab_t)) * CHAR_BIT / (objectSize * CHAR_BIT + 1);
+    return numObjects ? (numObjects + bitsPerEntry - 1) / bitsPerEntry : 1;
+}
+
+CRESULT slab_layout_init(kmem_slab_layout_t *layout, size_t objectSize, size_t align, enum Slab_Color colorMode)
+{
+    if (!layout || !objectSize)
         return PARAM_ERROR;
-    }
 
-    ASSERT(*l1CacheOffset % CACHE_L1_LINE_SIZE == 0);
+    if (!align)
+        align = 1;
+    if (!POWER_OF_TWO(align))
+        return PARAM_ERROR;
+
+    layout->align = align;
+    layout->objectSize = ALIGN_UP(objectSize, align);
+    layout->slabSize = slab_size_for_object(layout->objectSize, align);
+
+    // Colors only use memory that is left over after the last object, assuming worst alignment padding
+    const size_t usable = layout->slabSize - sizeof(kmem_slab_t) -
+                          slab_bitmap_entries(layout->slabSize, layout->objectSize) * sizeof(BitMapEntry) - (align - 1);
+    const size_t notUsedMemory = usable % layout->objectSize;
+
+    layout->colorMode = colorMode;
+    layout->colorStride = align > CACHE_L1_LINE_SIZE ? align : CACHE_L1_LINE_SIZE;
+    layout->colorCount = colorMode == SLAB_COLOR_NONE ? 1 : notUsedMemory / layout->colorStride + 1;
+    layout->colorNext = 0;
 
-    size_t sizeOfSlab = BLOCK_SIZE;
-    if (objectSize + sizeof(kmem_slab_t) > sizeOfSlab)
+    layout->reciprocal = RECIPROCAL_VALUE(layout->objectSize);
+    layout->reciprocalShift = RECIPROCAL_SHIFT(layout->objectSize);
+
+    return OK;
+}
+
+static size_t slab_layout_next_color(kmem_slab_layout_t *layout, const void *slabAddr)
+{
+    if (layout->colorMode == SLAB_COLOR_L2)
     {
-        sizeOfSlab = (objectSize + sizeof(kmem_slab_t) - 1) / BLOCK_SIZE + 1;
-        sizeOfSlab = (1 << BEST_FIT_BLOCKID(sizeOfSlab)) * BLOCK_SIZE; // TODO: Check
+        // Consecutive pages get consecutive colors, and pages a whole L2 way apart,
+        // which map to the same L2 sets, are shifted by one more color
+        const size_t page = (size_t)slabAddr / BLOCK_SIZE;
+        return (page + page / (CACHE_L2_WAY_SIZE / BLOCK_SIZE)) % layout->colorCount;
     }
 
-    EnterCriticalSection(&s_pBuddyHead->CriticalSection);
-    int code = buddy_alloc(sizeOfSlab, (void **)result);
-    LeaveCriticalSection(&s_pBuddyHead->CriticalSection);
+    const size_t color = layout->colorNext;
+    layout->colorNext = (layout->colorNext + 1) % layout->colorCount;
+    return color;
+}
+
+CRESULT get_slab_layout(kmem_slab_layout_t *layout, kmem_slab_t **result)
+{
+    if (!layout || !result)
+        return PARAM_ERROR;
+
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    int code = layout->slabSize >= HUGE_PAGE_SIZE ? buddy_alloc_aligned(layout->slabSize, HUGE_PAGE_SIZE, (void **)result)
+                                                  : buddy_alloc(layout->slabSize, (void **)result);
+    const bool zeroed = code == OK && buddy_is_zeroed(*result, layout->slabSize);
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
 
     if (code != OK)
     {
@@ -63,43 +104,48 @@ CRESULT get_slab(size_t objectSize, size_t *l1CacheOffset, kmem_slab_t **result)
         return code;
     }
 
-    (*result)->takenSlots = 0;
-    (*result)->next = NULL;
-    (*result)->prev = NULL;
-    (*result)->objectSize = objectSize;
-    (*result)->slabSize = sizeOfSlab;
-    (*result)->pBitmap = NULL;
-    (*result)->memStart = (void *)((size_t)(*result) + sizeof(kmem_slab_t));
-
-    kmem_slab_t* slab = *result;
-
-    const size_t bitMapEntry = (slab->slabSize - sizeof(kmem_slab_t)) / (slab->objectSize * CHAR_BIT * sizeof(BitMapEntry)) + 1;
-
-    const size_t NotUsedMemory = (sizeOfSlab - sizeof(kmem_slab_t) - bitMapEntry) % objectSize;
-
-    ASSERT(NotUsedMemory >= *l1CacheOffset);
+    kmem_slab_t *slab = *result;
+    slab->takenSlots = 0;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->objectSize = layout->objectSize;
+    slab->slabSize = layout->slabSize;
+    slab->reciprocal = layout->reciprocal;
+    slab->reciprocalShift = layout->reciprocalShift;
+    slab->pBitmap = NULL;
+    slab->list = NUM_TYPES;
+    slab->cpu = 0;
+    slab->zeroed = zeroed;
+    slab->cache = NULL;
+    slab->memStart = (void *)((size_t)slab + sizeof(kmem_slab_t));
+
+    TRACE(SLAB_GROW, slab, slab->slabSize);
+    get_slab_init_bitmap(slab);
+    slab->memStart = (void *)(ALIGN_UP((size_t)slab->memStart, layout->align) +
+                              slab_layout_next_color(layout, slab) * layout->colorStride);
+    slab->capacity = (slab->slabSize - ((size_t)slab->memStart - (size_t)slab)) / slab->objectSize;
 
-    (*result)->memStart = (void *)((size_t)(*result)->memStart + *l1CacheOffset);
+    return OK;
+}
 
-    if (NotUsedMemory >= *l1CacheOffset + CACHE_L1_LINE_SIZE)
-    {
-        *l1CacheOffset += CACHE_L1_LINE_SIZE;
-    }
-    else
+CRESULT get_slab(size_t objectSize, size_t *l1CacheOffset, kmem_slab_t **result)
+{
+    if (objectSize == 0 || !result || !l1CacheOffset)
     {
-        *l1CacheOffset = 0;
+        *result = NULL;
+        return PARAM_ERROR;
     }
 
-    ASSERT(NotUsedMemory >= *l1CacheOffset);
+    ASSERT(*l1CacheOffset % CACHE_L1_LINE_SIZE == 0);
 
-    get_slab_init_bitmap(*result);
-    const void* start = (*result)->memStart;
-    for (size_t i = (size_t)start; i + objectSize <= (size_t)*result + sizeOfSlab; i += objectSize)
-    {
-        setBitMap((*result), (i - (size_t)start) / (*result)->objectSize, 1);
-    }
+    kmem_slab_layout_t layout;
+    slab_layout_init(&layout, objectSize, 0, SLAB_COLOR_L1);
+    layout.colorNext = *l1CacheOffset / layout.colorStride % layout.colorCount;
 
-    return OK;
+    CRESULT code = get_slab_layout(&layout, result);
+    *l1CacheOffset = layout.colorNext * layout.colorStride;
+
+    return code;
 }
 
 CRESULT delete_slab(kmem_slab_t *slab)
@@ -113,9 +159,10 @@ CRESULT delete_slab(kmem_slab_t *slab)
         return SLAB_DELETE_FAIL;
     }
 
-    EnterCriticalSection(&s_pBuddyHead->CriticalSection);
-    buddy_free(slab, slab->slabSize);
-    LeaveCriticalSection(&s_pBuddyHead->CriticalSection);
+    TRACE(SLAB_SHRINK, slab, slab->slabSize);
+    LOCK_ENTER(&s_pBuddyHead->CriticalSection);
+    buddy_free(slab);
+    LOCK_LEAVE(&s_pBuddyHead->CriticalSection);
 }
 
 CRESULT slab_allocate(kmem_slab_t *slab, void **result)
@@ -126,30 +173,7 @@ CRESULT slab_allocate(kmem_slab_t *slab, void **result)
         return PARAM_ERROR;
     }
 
-    int objId = -1;
-    for (int i = 0; i < slab->numBitMapEntry; i++)
-    {
-        if (slab->pBitmap[i])
-        {
-            const int addr = i << BITMAP_NUM_BITS_ENTRY_POW_2;
-            const int off = FLS(slab->pBitmap[i]) - 1;
-
-            objId = (addr) + off;
-            break;
-        }
-    }
-
-    if (objId == -1)
-    {
-        *result = NULL;
-        return SLAB_FULL;
-    }
-
-    *result = (void *)((size_t)slab->memStart + slab->objectSize * objId);
-    setBitMap(slab, objId, 0);
-    slab->takenSlots++;
-
-    return OK;
+    return slab_allocate_sized(slab, slab->objectSize, result);
 }
 
 CRESULT slab_free(kmem_slab_t *slab, const void *ptr)
@@ -157,13 +181,16 @@ CRESULT slab_free(kmem_slab_t *slab, const void *ptr)
     if (!slab || !ptr)
         return PARAM_ERROR;
 
-    if (slab->memStart > ptr || (size_t)ptr >= (size_t)slab->memStart + slab->slabSize)
+    if (slab->memStart > ptr || (size_t)ptr >= (size_t)slab + slab->slabSize)
         return SLAB_DEALLOC_OBJECT_NOT_IN_SLAB;
 
-    if (((size_t)ptr - (size_t)slab->memStart) % slab->objectSize != 0)
+    const size_t offset = (size_t)ptr - (size_t)slab->memStart;
+    const int id = (int)RECIPROCAL_DIVIDE(offset, slab->reciprocal, slab->reciprocalShift);
+    if (id * slab->objectSize != offset)
         return SLAB_DEALLOC_NOT_VALID_ADDRES;
 
-    const int id = ((size_t)ptr - (size_t)slab->memStart) / slab->objectSize;
+    if (id >= slab->frontier || getBitMap(slab, id))
+        return SLAB_DEALLOC_NOT_VALID_ADDRES;
 
     setBitMap(slab, id, 1);
     slab->takenSlots--;
@@ -171,6 +198,17 @@ CRESULT slab_free(kmem_slab_t *slab, const void *ptr)
     return OK;
 }
 
+// Next allocated object at index *id or later, *id is moved past it. NULL when there is none
+void *slab_next_object(kmem_slab_t *slab, int *id)
+{
+    for (; *id < slab->frontier; (*id)++)
+    {
+        if (!getBitMap(slab, *id))
+            return (void *)((size_t)slab->memStart + slab->objectSize * (*id)++);
+    }
+    return NULL;
+}
+
 CRESULT slab_list_insert(kmem_slab_t **head, kmem_slab_t *slab) // TODO: Insert in sorted order by memory
 {
     if (!head || !slab)
@@ -190,6 +228,28 @@ CRESULT slab_list_insert(kmem_slab_t **head, kmem_slab_t *slab) // TODO: Insert
     return OK;
 }
 
+// Links slab behind prev, or at the head when prev is NULL
+CRESULT slab_list_insert_after(kmem_slab_t **head, kmem_slab_t *prev, kmem_slab_t *slab)
+{
+    if (!prev)
+        return slab_list_insert(head, slab);
+    if (!head || !slab)
+    {
+        ASSERT(0 && "Slab Param");
+        return PARAM_ERROR;
+    }
+
+    slab->prev = prev;
+    slab->next = prev->next;
+    if (prev->next)
+    {
+        prev->next->prev = slab;
+    }
+    prev->next = slab;
+
+    return OK;
+}
+
 CRESULT slab_list_delete(kmem_slab_t **head, kmem_slab_t *slab)
 {
     if (!head || !slab)
@@ -0,0 +1,165 @@
+#include "trace.h"
+#include <stdlib.h>
+#include <windows.h>
+
+typedef struct trace_ring_struct
+{
+    struct trace_ring_struct *next;
+    uint32_t threadId;
+    volatile size_t head; // Written only by producer
+    volatile size_t tail; // Written only by consumer
+    volatile size_t dropped;
+    volatile LONG inUse; // Cleared when the owner exits, a drained ring is then handed to a new thread
+    trace_record_t records[TRACE_RING_SIZE];
+} trace_ring_t;
+
+static trace_ring_t *volatile s_traceRings = NULL;
+static THREAD_LOCAL trace_ring_t *s_threadRing = NULL;
+
+static DWORD s_traceSlot = FLS_OUT_OF_INDEXES;
+
+static void WINAPI trace_thread_exit(void *data)
+{
+    trace_ring_t *ring = (trace_ring_t *)data;
+    if (ring)
+        InterlockedExchange(&ring->inUse, 0);
+}
+
+static void trace_watch_exit(trace_ring_t *ring)
+{
+    if (s_traceSlot == FLS_OUT_OF_INDEXES)
+    {
+        const DWORD slot = FlsAlloc(trace_thread_exit);
+        if (slot != FLS_OUT_OF_INDEXES &&
+            InterlockedCompareExchange((volatile LONG *)&s_traceSlot, (LONG)slot, (LONG)FLS_OUT_OF_INDEXES) !=
+                (LONG)FLS_OUT_OF_INDEXES)
+        {
+            FlsFree(slot);
+        }
+    }
+    if (s_traceSlot != FLS_OUT_OF_INDEXES)
+        FlsSetValue(s_traceSlot, ring);
+}
+
+static trace_ring_t *trace_register_ring()
+{
+    // Rings of exited threads are reused once the consumer drained them, so they are never freed
+    for (trace_ring_t *ring = s_traceRings; ring; ring = ring->next)
+    {
+        if (!ring->inUse && ring->tail == ring->head && !InterlockedCompareExchange(&ring->inUse, 1, 0))
+        {
+            ring->threadId = (uint32_t)GetCurrentThreadId();
+            trace_watch_exit(ring);
+            return ring;
+        }
+    }
+
+    trace_ring_t *ring = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+    if (!ring)
+        return NULL;
+
+    ring->threadId = (uint32_t)GetCurrentThreadId();
+    ring->inUse = 1;
+    trace_ring_t *head;
+    do
+    {
+        head = s_traceRings;
+        ring->next = head;
+    } while (InterlockedCompareExchangePointer((void *volatile *)&s_traceRings, ring, head) != head);
+
+    trace_watch_exit(ring);
+    return ring;
+}
+
+void trace_emit(uint16_t event, uint64_t arg0, uint64_t arg1)
+{
+    trace_ring_t *ring = s_threadRing;
+    if (!ring)
+    {
+        ring = s_threadRing = trace_register_ring();
+        if (!ring)
+            return;
+    }
+
+    const size_t head = ring->head;
+    if (head - ring->tail == TRACE_RING_SIZE)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    trace_record_t *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->timestamp = read_timestamp();
+    record->threadId = ring->threadId;
+    record->event = event;
+    record->reserved = 0;
+    record->arg0 = arg0;
+    record->arg1 = arg1;
+
+    MemoryBarrier();
+    ring->head = head + 1;
+}
+
+size_t trace_drain(trace_record_t *out, size_t maxRecords)
+{
+    if (!out)
+        return 0;
+
+    size_t cnt = 0;
+    for (trace_ring_t *ring = s_traceRings; ring && cnt < maxRecords; ring = ring->next)
+    {
+        const size_t head = ring->head;
+        MemoryBarrier();
+        size_t tail = ring->tail;
+        for (; tail != head && cnt < maxRecords; tail++)
+        {
+            out[cnt++] = ring->records[tail & (TRACE_RING_SIZE - 1)];
+        }
+        MemoryBarrier();
+        ring->tail = tail;
+    }
+
+    return cnt;
+}
+
+CRESULT trace_dump(FILE *file)
+{
+    if (!file)
+        return PARAM_ERROR;
+
+    trace_file_header_t header;
+    header.magic = TRACE_FILE_MAGIC;
+    header.version = TRACE_FILE_VERSION;
+    header.recordSize = sizeof(trace_record_t);
+    header.reserved = 0;
+    header.timestampFrequency = read_timestamp_frequency();
+    header.numRecords = 0;
+
+    const long headerPos = ftell(file);
+    if (fwrite(&header, sizeof(header), 1, file) != 1)
+        return FAIL;
+
+    trace_record_t buffer[256];
+    size_t cnt;
+    while ((cnt = trace_drain(buffer, sizeof(buffer) / sizeof(buffer[0]))) != 0)
+    {
+        if (fwrite(buffer, sizeof(trace_record_t), cnt, file) != cnt)
+            return FAIL;
+        header.numRecords += cnt;
+    }
+
+    const long endPos = ftell(file);
+    fseek(file, headerPos, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, file);
+    fseek(file, endPos, SEEK_SET);
+
+    return OK;
+}
+
+size_t trace_dropped()
+{
+    size_t cnt = 0;
+    for (trace_ring_t *ring = s_traceRings; ring; ring = ring->next)
+        cnt += ring->dropped;
+    return cnt;
+}
@@ -2,6 +2,7 @@
 #include "error_codes.h"
 #include "helper.h"
 #include "tests.h"
+#include <string.h>
 
 extern buddy_allocator_t *s_pBuddyHead;
 void *unusedPointer;
@@ -32,7 +33,7 @@ BUDDY_TEST_START(alloc_free)
         void *ptr;
         tst_OK(buddy_alloc(mem, &ptr));
         tst_assert(ptr);
-        buddy_free(ptr, mem);
+        buddy_free(ptr);
     }
 
     size_t check_sum = 0;
@@ -57,7 +58,7 @@ BUDDY_TEST_START(full_alloc_free)
 
     for (int i = 0; i < num_blocks; i++)
     {
-        tst_OK(buddy_free(ptr[i], BUDDY_BLOCK_SIZE));
+        tst_OK(buddy_free(ptr[i]));
     }
     size_t check_sum = 0;
     for (int i = 0; i < BEST_FIT_BLOCKID(num_blocks) + 1; i++)
@@ -82,7 +83,7 @@ BUDDY_TEST_START(full_alloc_free_32)
 
     for (int i = 0; i < num_blocks / 32; i++)
     {
-        tst_OK(buddy_free(ptr[i], size * BUDDY_BLOCK_SIZE));
+        tst_OK(buddy_free(ptr[i]));
     }
     size_t check_sum = 0;
     for (int i = 0; i < BEST_FIT_BLOCKID(num_blocks) + 1; i++)
@@ -95,6 +96,247 @@ BUDDY_TEST_START(full_alloc_free_32)
 }
 BUDDY_TEST_END
 
+BUDDY_TEST_START(order_tags)
+{
+    if (num_blocks < 4)
+        return true;
+
+    void *small, *big;
+    tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &small));
+    tst_OK(buddy_alloc(3 * BUDDY_BLOCK_SIZE, &big));
+    tst_assert(buddy_usable_size(small) == BUDDY_BLOCK_SIZE);
+    tst_assert(buddy_usable_size(big) == 4 * BUDDY_BLOCK_SIZE);
+
+    // Only allocated block heads can be freed
+    tst_assert(buddy_usable_size((char *)big + BUDDY_BLOCK_SIZE) == 0);
+    tst_FAIL(buddy_free((char *)big + BUDDY_BLOCK_SIZE));
+    tst_FAIL(buddy_free((char *)small + 1));
+
+    // Marks belong to allocation heads and go away with the allocation
+    tst_OK(buddy_set_mark(big, 7));
+    tst_assert(buddy_get_mark(big) == 7 && buddy_get_mark(small) == 0);
+    tst_FAIL(buddy_set_mark((char *)big + BUDDY_BLOCK_SIZE, 7));
+    tst_assert(buddy_get_mark((char *)big + BUDDY_BLOCK_SIZE) == 0);
+
+    tst_OK(buddy_free(small));
+    tst_FAIL(buddy_free(small));
+    tst_assert(buddy_usable_size(small) == 0);
+    tst_OK(buddy_free(big));
+    tst_assert(buddy_get_mark(big) == 0);
+    tst_FAIL(buddy_set_mark(big, 7));
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(untouched_memory)
+{
+    // Split and merge only use descriptors, block memory keeps whatever was there
+    const size_t memorySize = num_blocks * BUDDY_BLOCK_SIZE;
+    memset(s_pBuddyHead->vpMemoryStart, 0xA5, memorySize);
+
+    void **ptr = malloc(num_blocks * sizeof(void *));
+    for (int i = 0; i < num_blocks; i++)
+    {
+        tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &ptr[i]));
+    }
+    for (int i = 0; i < num_blocks; i += 2)
+    {
+        tst_OK(buddy_free(ptr[i]));
+    }
+    for (int i = 1; i < num_blocks; i += 2)
+    {
+        tst_OK(buddy_free(ptr[i]));
+    }
+    free(ptr);
+
+    for (size_t i = 0; i < memorySize; i++)
+    {
+        tst_assert(((uint8_t *)s_pBuddyHead->vpMemoryStart)[i] == 0xA5);
+    }
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(hot_cache)
+{
+    const size_t Watermark = 4;
+    buddy_stats_t stats;
+    tst_OK(buddy_hot_cache_set(Watermark));
+
+    void *first, *again;
+    tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &first));
+    tst_OK(buddy_free(first));
+    tst_FAIL(buddy_free(first));
+    tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &again));
+    tst_assert(first == again);
+    tst_OK(buddy_get_stats(&stats));
+    tst_assert(stats.hotFrees == 1 && stats.hotHits == 1);
+    tst_OK(buddy_free(again));
+
+    void **ptr = malloc(num_blocks * sizeof(void *));
+    for (int i = 0; i < num_blocks - 1; i++)
+    {
+        tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &ptr[i]));
+    }
+    for (int i = 0; i < num_blocks - 1; i++)
+    {
+        tst_OK(buddy_free(ptr[i]));
+        tst_assert(s_pBuddyHead->hot[0].count <= Watermark);
+    }
+    free(ptr);
+
+    // Blocks held by the hot cache are merged when a bigger allocation needs them
+    const size_t mem = (ROUND_TO_POWER_OF_TWO(num_blocks) >> 1) * BUDDY_BLOCK_SIZE;
+    void *big;
+    if (mem)
+    {
+        tst_OK(buddy_alloc(mem, &big));
+        tst_OK(buddy_free(big));
+    }
+    buddy_hot_cache_drain();
+    tst_assert(s_pBuddyHead->hot[0].count == 0);
+
+    size_t check_sum = 0;
+    for (int i = 0; i < BEST_FIT_BLOCKID(num_blocks) + 1; i++)
+    {
+        check_sum += ((s_pBuddyHead->vpMemoryBlocks[i].block != NULL) << i);
+    }
+    tst_assert(check_sum == num_blocks);
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(exact_alloc)
+{
+    const size_t Sizes[] = {3, 5, 6, 7, 9, 13};
+    void **ptr = malloc(num_blocks * sizeof(void *));
+    for (int s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++)
+    {
+        if (Sizes[s] > num_blocks / 2)
+            break;
+
+        void *run;
+        tst_OK(buddy_alloc_exact(Sizes[s] * BUDDY_BLOCK_SIZE, &run));
+        tst_assert(buddy_usable_size(run) == Sizes[s] * BUDDY_BLOCK_SIZE);
+        tst_FAIL(buddy_free((char *)run + (Sizes[s] - 1) * BUDDY_BLOCK_SIZE));
+        tst_assert(buddy_block_start((char *)run + (Sizes[s] - 1) * BUDDY_BLOCK_SIZE + 1) == run);
+
+        // Trimmed tail is usable by others
+        int taken = 0;
+        while (buddy_alloc(BUDDY_BLOCK_SIZE, &ptr[taken]) == OK)
+            taken++;
+        tst_assert(taken == num_blocks - Sizes[s]);
+
+        tst_OK(buddy_free(run));
+        tst_assert(!buddy_block_start(run));
+        for (int i = 0; i < taken; i++)
+        {
+            tst_OK(buddy_free(ptr[i]));
+        }
+
+        size_t check_sum = 0;
+        for (int i = 0; i < BEST_FIT_BLOCKID(num_blocks) + 1; i++)
+        {
+            check_sum += ((s_pBuddyHead->vpMemoryBlocks[i].block != NULL) << i);
+            tst_assert(!s_pBuddyHead->vpMemoryBlocks[i].block ||
+                       (!s_pBuddyHead->vpMemoryBlocks[i].block->next && "Has Only One in Entry"));
+        }
+        tst_assert(check_sum == num_blocks);
+    }
+    free(ptr);
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(aligned_alloc)
+{
+    tst_assert((size_t)s_pBuddyHead->vpMemoryStart % BUDDY_REGION_ALIGN == 0);
+
+    const size_t Aligns[] = {BUDDY_BLOCK_SIZE, 16 * BUDDY_BLOCK_SIZE, 64 * BUDDY_BLOCK_SIZE};
+    const size_t Sizes[] = {1, 3, 16};
+    void *unaligned, *ptr;
+    for (int a = 0; a < sizeof(Aligns) / sizeof(Aligns[0]); a++)
+    {
+        for (int s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++)
+        {
+            if (Sizes[s] * BUDDY_BLOCK_SIZE + Aligns[a] > num_blocks * BUDDY_BLOCK_SIZE / 2)
+                continue;
+
+            // Shift the free lists so blocks are not aligned by chance
+            tst_OK(buddy_alloc(BUDDY_BLOCK_SIZE, &unaligned));
+            tst_OK(buddy_alloc_aligned(Sizes[s] * BUDDY_BLOCK_SIZE, Aligns[a], &ptr));
+            tst_assert((size_t)ptr % Aligns[a] == 0);
+            tst_assert(buddy_usable_size(ptr) == Sizes[s] * BUDDY_BLOCK_SIZE);
+            tst_OK(buddy_free(ptr));
+            tst_OK(buddy_free(unaligned));
+
+            size_t check_sum = 0;
+            for (int i = 0; i < BEST_FIT_BLOCKID(num_blocks) + 1; i++)
+            {
+                check_sum += ((s_pBuddyHead->vpMemoryBlocks[i].block != NULL) << i);
+            }
+            tst_assert(check_sum == num_blocks);
+        }
+    }
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(large_alloc)
+{
+    // Seeded chunks are smaller than the request, only a run over several of them fits
+    const size_t numLarge = ROUND_TO_POWER_OF_TWO(num_blocks) / 2 + 1;
+    if (numLarge >= num_blocks || POWER_OF_TWO(num_blocks))
+        return true;
+
+    void *ptr, *small;
+    tst_FAIL(buddy_alloc_exact(numLarge * BUDDY_BLOCK_SIZE, &ptr));
+    tst_OK(buddy_alloc_large(numLarge * BUDDY_BLOCK_SIZE, &ptr));
+    tst_assert(ptr == s_pBuddyHead->vpMemoryStart);
+    tst_assert(buddy_usable_size(ptr) == numLarge * BUDDY_BLOCK_SIZE);
+
+    buddy_stats_t stats;
+    tst_OK(buddy_get_stats(&stats));
+    tst_assert(stats.largeExtents == 1);
+
+    // Everything not in the run stays usable
+    int taken = 0;
+    while (buddy_alloc(BUDDY_BLOCK_SIZE, &small) == OK)
+        taken++;
+    tst_assert(taken == num_blocks - numLarge);
+    tst_OK(buddy_free(ptr));
+    tst_FAIL(buddy_free(ptr));
+}
+BUDDY_TEST_END
+
+BUDDY_TEST_START(extend)
+{
+    void **ptr = malloc(num_blocks * sizeof(void *));
+    int taken = 0;
+    while (buddy_alloc(BUDDY_BLOCK_SIZE, &ptr[taken]) == OK)
+        taken++;
+    tst_assert(taken == num_blocks);
+
+    // Only the block right after the first one is free
+    char *first = s_pBuddyHead->vpMemoryStart;
+    tst_OK(buddy_free(first + BUDDY_BLOCK_SIZE));
+    tst_OK(buddy_extend(first, BUDDY_BLOCK_SIZE));
+    tst_OK(buddy_extend(first, 2 * BUDDY_BLOCK_SIZE));
+    tst_assert(buddy_usable_size(first) == 2 * BUDDY_BLOCK_SIZE);
+    tst_assert(buddy_block_start(first + BUDDY_BLOCK_SIZE) == first);
+    tst_FAIL(buddy_extend(first, 3 * BUDDY_BLOCK_SIZE));
+    tst_FAIL(buddy_extend(first + BUDDY_BLOCK_SIZE, 3 * BUDDY_BLOCK_SIZE));
+
+    for (int i = 0; i < taken; i++)
+    {
+        if (ptr[i] != first + BUDDY_BLOCK_SIZE)
+            tst_OK(buddy_free(ptr[i]));
+    }
+    tst_FAIL(buddy_free(first + BUDDY_BLOCK_SIZE));
+
+    taken = 0;
+    while (buddy_alloc(BUDDY_BLOCK_SIZE, &ptr[taken]) == OK)
+        taken++;
+    tst_assert(taken == num_blocks);
+    free(ptr);
+}
+BUDDY_TEST_END
+
 TEST_SUITE_START(buddy, 1024)
 {
     SUITE_ADD(full_range_memory);
@@ -102,6 +344,13 @@ TEST_SUITE_START(buddy, 1024)
     SUITE_ADD(alloc_free);
     SUITE_ADD(full_alloc_free);
     SUITE_ADD(full_alloc_free_32);
+    SUITE_ADD(order_tags);
+    SUITE_ADD(untouched_memory);
+    SUITE_ADD(hot_cache);
+    SUITE_ADD(exact_alloc);
+    SUITE_ADD(aligned_alloc);
+    SUITE_ADD(large_alloc);
+    SUITE_ADD(extend);
 }
 TEST_SUITE_END
 
@@ -112,5 +361,11 @@ TEST_SUITE_START(buddy_2, 3)
     SUITE_ADD(alloc_free);
     SUITE_ADD(full_alloc_free);
     SUITE_ADD(full_alloc_free_32);
+    SUITE_ADD(order_tags);
+    SUITE_ADD(untouched_memory);
+    SUITE_ADD(hot_cache);
+    SUITE_ADD(exact_alloc);
+    SUITE_ADD(aligned_alloc);
+    SUITE_ADD(extend);
 }
 TEST_SUITE_END
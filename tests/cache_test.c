@@ -1,7 +1,9 @@
 #include "buddy/buddy.h"
 #include "helper.h"
 #include "slab_impl.h"
+#include "slab_typed.h"
 #include "tests.h"
+#include <string.h>
 
 extern kmem_cache_t *s_cacheHead;
 
@@ -22,6 +24,15 @@ SLAB_TEST_START(cache_create)
         {
             cnt += NUMBER_OF_OBJECTS_IN_SLAB(start);
         }
+    for (int cpu = 0; cpu < KMEM_MAX_CPUS; cpu++)
+    {
+        if (s_cacheHead->cpuSlab[cpu].pActive)
+            cnt += NUMBER_OF_OBJECTS_IN_SLAB(s_cacheHead->cpuSlab[cpu].pActive);
+        for (kmem_slab_t *start = s_cacheHead->cpuSlab[cpu].pPartial; start; start = start->next)
+        {
+            cnt += NUMBER_OF_OBJECTS_IN_SLAB(start);
+        }
+    }
     tst_assert(cnt >= ITER);
 }
 SLAB_TEST_END
@@ -135,6 +146,541 @@ SLAB_TEST_START(cache_create_alloc_delete_destructor)
 }
 SLAB_TEST_END
 
+SLAB_TEST_START(cache_lock_stats)
+{
+    kmem_cache_t *cache = kmem_cache_create("LockStats", objSize, NULL, NULL);
+    tst_assert(cache);
+    const int ITER = 100;
+    void *objects[100];
+    for (int i = 0; i < ITER; i++)
+    {
+        objects[i] = kmem_cache_alloc(cache);
+        tst_assert(objects[i]);
+    }
+    for (int i = 0; i < ITER; i++)
+    {
+        kmem_cache_free(cache, objects[i]);
+    }
+
+    kmem_lock_stats_t stats;
+#ifdef LOCK_STATS
+    tst_OK(kmem_cache_lock_stats(cache, &stats));
+    tst_assert(stats.acquisitions == 2 * ITER);
+    tst_assert(stats.contended == 0);
+    tst_assert(stats.holdMax <= stats.holdTotal);
+    tst_OK(kmem_lock_stats("LockStats", &stats));
+    tst_assert(stats.acquisitions == 2 * ITER);
+    tst_OK(kmem_lock_stats("size-32", &stats));
+    tst_OK(kmem_lock_stats("buddy", &stats));
+    tst_assert(stats.acquisitions > 0);
+#else
+    tst_FAIL(kmem_cache_lock_stats(cache, &stats));
+#endif // LOCK_STATS
+    tst_FAIL(kmem_lock_stats("NoSuchCache", &stats));
+    kmem_cache_destroy(cache);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(cache_aligned)
+{
+    const size_t sizes[] = {8, 40, 64, 100, 3000};
+    const size_t aligns[] = {0, 8, 32, 64, 256, 4096};
+    void *objects[BLOCK_SIZE];
+    tst_assert(!kmem_cache_create_aligned("BadAlign", 64, 24, 0, NULL, NULL));
+
+    for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        for (int a = 0; a < sizeof(aligns) / sizeof(aligns[0]); a++)
+            for (unsigned flags = 0; flags <= SLAB_HWCACHE_ALIGN; flags++)
+            {
+                kmem_cache_t *cache = kmem_cache_create_aligned("Aligned", sizes[s], aligns[a], flags, NULL, NULL);
+                tst_assert(cache);
+                size_t align = aligns[a] ? aligns[a] : 1;
+                if (flags & SLAB_HWCACHE_ALIGN && sizes[s] > CACHE_L1_LINE_SIZE / 2 && align < CACHE_L1_LINE_SIZE)
+                    align = CACHE_L1_LINE_SIZE;
+
+                const int ITER = 50;
+                for (int i = 0; i < ITER; i++)
+                {
+                    objects[i] = kmem_cache_alloc(cache);
+                    tst_assert(objects[i]);
+                    tst_assert((size_t)objects[i] % align == 0);
+                    for (int j = 0; j < i; j++)
+                    {
+                        const size_t diff = objects[i] > objects[j] ? (size_t)objects[i] - (size_t)objects[j]
+                                                                    : (size_t)objects[j] - (size_t)objects[i];
+                        tst_assert(diff >= sizes[s]);
+                    }
+                }
+                for (int i = 0; i < ITER; i++)
+                {
+                    kmem_cache_free(cache, objects[i]);
+                    tst_OK(cache->errorFlags);
+                }
+                kmem_cache_destroy(cache);
+            }
+
+    // Color mode flags
+    const unsigned Flags[] = {0, SLAB_L2_COLOR, SLAB_NO_COLOR};
+    const enum Slab_Color Modes[] = {SLAB_COLOR_L1, SLAB_COLOR_L2, SLAB_COLOR_NONE};
+    for (int f = 0; f < sizeof(Flags) / sizeof(Flags[0]); f++)
+    {
+        kmem_cache_t *cache = kmem_cache_create_aligned("Colored", 700, 0, Flags[f], NULL, NULL);
+        tst_assert(cache && cache->layout.colorMode == Modes[f]);
+        tst_assert(Modes[f] != SLAB_COLOR_NONE || cache->layout.colorCount == 1);
+        kmem_cache_free(cache, kmem_cache_alloc(cache));
+        tst_OK(cache->errorFlags);
+        kmem_cache_destroy(cache);
+    }
+}
+SLAB_TEST_END
+
+static int Shrinker_Calls = 0;
+static size_t shrinker(void *context, size_t pagesWanted)
+{
+    (*(int *)context)++;
+    return 0;
+}
+
+SLAB_TEST_START(cache_reclaim)
+{
+    kmem_cache_t *cacheA = kmem_cache_create("ReclaimA", Obj_Size, NULL, NULL);
+    kmem_cache_t *cacheB = kmem_cache_create("ReclaimB", 2 * Obj_Size, NULL, NULL);
+    tst_assert(cacheA && cacheB);
+
+    // A takes all memory and gives it back only as EMPTY slabs
+    void **ptr = malloc(MEMORY_SIZE * BLOCK_SIZE / Obj_Size * sizeof(void *));
+    int numA = 0;
+    while ((ptr[numA] = kmem_cache_alloc(cacheA)))
+        numA++;
+    tst_assert(numA > 0);
+    cacheA->errorFlags = OK;
+    for (int i = 0; i < numA; i++)
+    {
+        kmem_cache_free(cacheA, ptr[i]);
+    }
+    tst_assert(cacheA->pSlab[EMPTY]);
+
+    tst_OK(kmem_register_shrinker(shrinker, &Shrinker_Calls));
+    kmem_reclaim_stats_t before, after;
+    kmem_reclaim_stats(&before);
+
+    int numB = 0;
+    while ((ptr[numB] = kmem_cache_alloc(cacheB)))
+        numB++;
+    cacheB->errorFlags = OK;
+    kmem_reclaim_stats(&after);
+
+    // B got memory of A, and once A had nothing left the shrinker was asked too
+    tst_assert(numB > numA / 4);
+    tst_assert(!cacheA->pSlab[EMPTY]);
+    tst_assert(after.passes > before.passes);
+    tst_assert(after.pagesRecovered > before.pagesRecovered);
+    tst_assert(after.failures > before.failures);
+    tst_assert(Shrinker_Calls > 0);
+    tst_OK(kmem_unregister_shrinker(shrinker, &Shrinker_Calls));
+    tst_FAIL(kmem_unregister_shrinker(shrinker, &Shrinker_Calls));
+
+    for (int i = 0; i < numB; i++)
+    {
+        kmem_cache_free(cacheB, ptr[i]);
+    }
+    free(ptr);
+    kmem_cache_destroy(cacheA);
+    kmem_cache_destroy(cacheB);
+}
+SLAB_TEST_END
+
+typedef struct reclaim_probe_struct
+{
+    kmem_cache_t *cache;
+    void **objects;
+    int numObjects;
+    int calls;
+    bool unlocked; // Another thread could take the cache and chain locks while the shrinker ran
+} reclaim_probe_t;
+
+static DWORD WINAPI reclaim_probe_locks(LPVOID arg)
+{
+    reclaim_probe_t *probe = (reclaim_probe_t *)arg;
+    const bool cache = LOCK_TRY_ENTER(&probe->cache->CriticalSection);
+    const bool chain = LOCK_TRY_ENTER(&s_cacheHead->CriticalSection);
+    probe->unlocked = cache && chain;
+    if (chain)
+        LOCK_LEAVE(&s_cacheHead->CriticalSection);
+    if (cache)
+        LOCK_LEAVE(&probe->cache->CriticalSection);
+    return 0;
+}
+
+static size_t freeing_shrinker(void *context, size_t pagesWanted)
+{
+    reclaim_probe_t *probe = (reclaim_probe_t *)context;
+    HANDLE thread = CreateThread(NULL, 0, reclaim_probe_locks, probe, 0, NULL);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+
+    // Frees into the cache whose allocation asked for memory
+    for (int i = 0; i < probe->numObjects; i++)
+        kmem_cache_free(probe->cache, probe->objects[i]);
+    probe->numObjects = 0;
+    probe->calls++;
+    return pagesWanted;
+}
+
+SLAB_TEST_START(cache_reclaim_unlocked)
+{
+    reclaim_probe_t probe = {0};
+    probe.cache = kmem_cache_create("ReclaimUnlocked", Obj_Size, NULL, NULL);
+    void **ptr = malloc(MEMORY_SIZE * BLOCK_SIZE / Obj_Size * sizeof(void *));
+    int num = 0;
+    while ((ptr[num] = kmem_cache_alloc(probe.cache)))
+        num++;
+    probe.cache->errorFlags = OK;
+
+    probe.objects = ptr;
+    probe.numObjects = num / 2;
+    tst_OK(kmem_register_shrinker(freeing_shrinker, &probe));
+    void *obj = kmem_cache_alloc(probe.cache);
+    tst_assert(obj);
+    tst_OK(probe.cache->errorFlags);
+    tst_assert(probe.calls == 1 && probe.unlocked);
+    tst_OK(kmem_unregister_shrinker(freeing_shrinker, &probe));
+
+    kmem_cache_free(probe.cache, obj);
+    for (int i = num / 2; i < num; i++)
+        kmem_cache_free(probe.cache, ptr[i]);
+    free(ptr);
+    kmem_cache_destroy(probe.cache);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(cache_reclaimer)
+{
+    const int Slabs = 8;
+    kmem_cache_t *cache = kmem_cache_create("Reclaimer", Obj_Size, NULL, NULL);
+    const int numObjects = Slabs * _numberOfObjectsInSlab;
+    void **ptr = malloc(numObjects * sizeof(void *));
+    for (int i = 0; i < numObjects; i++)
+    {
+        ptr[i] = kmem_cache_alloc(cache);
+        tst_assert(ptr[i]);
+    }
+    for (int i = 0; i < numObjects; i++)
+    {
+        kmem_cache_free(cache, ptr[i]);
+    }
+    free(ptr);
+    tst_assert(cache->pSlab[EMPTY]);
+
+    // One slab per pass, so several passes are needed. The CPU active slab is never EMPTY listed
+    kmem_reclaim_stats_t stats;
+    tst_OK(kmem_reclaimer_start(1, 2, 1));
+    tst_FAIL(kmem_reclaimer_start(1, 2, 1));
+    for (int wait = 0; wait < 2000; wait++)
+    {
+        kmem_reclaim_stats(&stats);
+        if (stats.backgroundSlabs >= Slabs - 1)
+            break;
+        Sleep(1);
+    }
+    kmem_reclaimer_stop();
+
+    kmem_reclaim_stats(&stats);
+    tst_assert(stats.backgroundSlabs >= Slabs - 1);
+    tst_assert(stats.backgroundPasses >= Slabs - 1);
+    tst_assert(!cache->pEmptyTail == !cache->pSlab[EMPTY]);
+    kmem_cache_destroy(cache);
+}
+SLAB_TEST_END
+
+static void **Defrag_Table;
+static int defrag_move(void *from, void *to)
+{
+    memcpy(to, from, sizeof(int));
+    Defrag_Table[*(int *)to] = to;
+    return 1;
+}
+
+static int defrag_pin(void *from, void *to)
+{
+    return 0;
+}
+
+SLAB_TEST_START(cache_defrag)
+{
+    const int Slabs = 8;
+    kmem_cache_t *cache = kmem_cache_create("Defrag", objSize, NULL, NULL);
+    const int numObjects = Slabs * _numberOfObjectsInSlab;
+    Defrag_Table = malloc(numObjects * sizeof(void *));
+    for (int i = 0; i < numObjects; i++)
+    {
+        Defrag_Table[i] = kmem_cache_alloc(cache);
+        tst_assert(Defrag_Table[i]);
+        *(int *)Defrag_Table[i] = i;
+    }
+
+    // Every slab keeps a quarter of its objects
+    for (int i = 0; i < numObjects; i++)
+    {
+        if (i % 4)
+        {
+            kmem_cache_free(cache, Defrag_Table[i]);
+            Defrag_Table[i] = NULL;
+        }
+    }
+
+    tst_assert(kmem_cache_defrag(cache, defrag_pin) == 0);
+    tst_assert(kmem_cache_defrag(cache, defrag_move) >= Slabs / 2);
+    tst_assert(!cache->pPartialTail == !cache->pSlab[HAS_SPACE]);
+    for (int i = 0; i < numObjects; i += 4)
+    {
+        tst_assert(*(int *)Defrag_Table[i] == i);
+        kmem_cache_free(cache, Defrag_Table[i]);
+    }
+    free(Defrag_Table);
+    kmem_cache_destroy(cache);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(cache_alloc_hint)
+{
+    const int Slabs = 3;
+    kmem_cache_t *cache = kmem_cache_create("Hint", objSize, NULL, NULL);
+    const int numObjects = Slabs * _numberOfObjectsInSlab;
+    void **ptr = malloc(numObjects * sizeof(void *));
+    for (int i = 0; i < numObjects; i++)
+    {
+        ptr[i] = kmem_cache_alloc(cache);
+        tst_assert(ptr[i]);
+    }
+
+    // First slab is FULL and not the active one, a hint still lands in it
+    kmem_cache_free(cache, ptr[1]);
+    kmem_cache_free(cache, ptr[2]);
+    for (int i = 1; i <= 2; i++)
+    {
+        ptr[i] = kmem_cache_alloc_hint(cache, ptr[0]);
+        tst_assert(ptr[i]);
+        tst_assert(buddy_block_start(ptr[i]) == buddy_block_start(ptr[0]));
+    }
+
+    // Full slab of the hint falls back to the region or the normal path
+    void *extra = kmem_cache_alloc_hint(cache, ptr[0]);
+    tst_assert(extra);
+    tst_assert(buddy_block_start(extra) != buddy_block_start(ptr[0]));
+    kmem_cache_free(cache, extra);
+    extra = kmem_cache_alloc_hint(cache, NULL);
+    tst_assert(extra);
+    kmem_cache_free(cache, extra);
+
+    // Hints this cache doesn't own are only a region preference
+    kmem_cache_t *other = kmem_cache_create("HintOther", objSize, NULL, NULL);
+    void *foreign = kmem_cache_alloc(other);
+    void *large = kmalloc((1 << BUFFER_SIZE_MAX) + 1);
+    kmem_slab_t *fake = (kmem_slab_t *)large; // Looks like a slab of cache with room
+    memcpy(fake, buddy_block_start(ptr[0]), sizeof(kmem_slab_t));
+    fake->takenSlots = 0;
+    const void *Hints[] = {foreign, large, (char *)large + 64};
+    for (int h = 0; h < sizeof(Hints) / sizeof(Hints[0]); h++)
+    {
+        extra = kmem_cache_alloc_hint(cache, Hints[h]);
+        tst_assert(extra);
+        tst_assert(((kmem_slab_t *)buddy_block_start(extra))->cache == cache);
+        kmem_cache_free(cache, extra);
+        tst_OK(cache->errorFlags);
+    }
+    tst_assert(((kmem_slab_t *)buddy_block_start(foreign))->takenSlots == 1 && fake->takenSlots == 0);
+    kmem_cache_free(other, foreign);
+    kmem_cache_destroy(other);
+    extra = kmem_cache_alloc_hint(cache, foreign);
+    tst_assert(extra && ((kmem_slab_t *)buddy_block_start(extra))->cache == cache);
+    kmem_cache_free(cache, extra);
+    kfree(large);
+
+    for (int i = 0; i < numObjects; i++)
+    {
+        kmem_cache_free(cache, ptr[i]);
+    }
+    free(ptr);
+    kmem_cache_destroy(cache);
+}
+SLAB_TEST_END
+
+static bool is_zero(const void *ptr, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (((const char *)ptr)[i])
+            return false;
+    }
+    return true;
+}
+
+SLAB_TEST_START(cache_zalloc)
+{
+    // Arena from malloc is not known zero, every object is cleared
+    kmem_cache_t *cache = kmem_cache_create("Zalloc", objSize, NULL, NULL);
+    void *obj = kmem_cache_alloc(cache);
+    memset(obj, 0xFF, objSize);
+    kmem_cache_free(cache, obj);
+    obj = kmem_cache_zalloc(cache);
+    tst_assert(obj && is_zero(obj, objSize));
+    tst_assert(!((kmem_slab_t *)buddy_block_start(obj))->zeroed);
+    kmem_cache_free(cache, obj);
+    kmem_cache_destroy(cache);
+
+    // Zeroed arena, only reused slots need clearing
+    void *arena = calloc(MEMORY_SIZE, BLOCK_SIZE);
+    kmem_init_zeroed(arena, MEMORY_SIZE);
+    cache = kmem_cache_create("Zalloc", objSize, NULL, NULL);
+    obj = kmem_cache_zalloc(cache);
+    tst_assert(obj && is_zero(obj, objSize));
+    tst_assert(((kmem_slab_t *)buddy_block_start(obj))->zeroed);
+    memset(obj, 0xFF, objSize);
+    kmem_cache_free(cache, obj);
+    obj = kmem_cache_zalloc(cache);
+    tst_assert(obj && is_zero(obj, objSize));
+    kmem_cache_free(cache, obj);
+
+    // Slab given back to buddy is dirty when it comes back
+    kmem_cache_shrink(cache);
+    obj = kmem_cache_alloc(cache);
+    tst_assert(!((kmem_slab_t *)buddy_block_start(obj))->zeroed);
+    kmem_cache_free(cache, obj);
+    kmem_cache_destroy(cache);
+
+    kmem_init(_ptr, MEMORY_SIZE);
+    free(arena);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(cache_foreign_free)
+{
+    // Same object size as each other and as a kmalloc class, only the owner takes objects back
+    kmem_cache_t *cacheA = kmem_cache_create("ForeignA", objSize, NULL, NULL);
+    kmem_cache_t *cacheB = kmem_cache_create("ForeignB", objSize, NULL, NULL);
+    void *obj = kmem_cache_alloc(cacheA);
+    tst_assert(obj);
+    kmem_slab_t *slab = buddy_block_start(obj);
+    tst_assert(slab->cache == cacheA && slab->takenSlots == 1);
+
+    kmem_cache_free(cacheB, obj);
+    tst_assert(cacheB->errorFlags != OK);
+    kfree(obj);
+    kfree(slab); // Slab header is no large buffer
+    tst_assert(buddy_block_start(obj) == slab);
+    tst_assert(slab->cache == cacheA && slab->takenSlots == 1);
+
+    kmem_cache_free(cacheA, obj);
+    tst_OK(cacheA->errorFlags);
+    tst_assert(slab->takenSlots == 0);
+    kmem_cache_destroy(cacheA);
+    kmem_cache_destroy(cacheB);
+}
+SLAB_TEST_END
+
+typedef struct typed_small_struct
+{
+    int key;
+    char data[20];
+} typed_small_t;
+
+typedef struct typed_big_struct
+{
+    char data[5000];
+} typed_big_t;
+
+DEFINE_KMEM_CACHE(typed_small, typed_small_t, 16)
+DEFINE_KMEM_CACHE(typed_big, typed_big_t, 0)
+
+SLAB_TEST_START(cache_typed)
+{
+    // 5000 byte objects need two block slabs
+    tst_assert(typed_small_cache_create() && typed_big_cache_create());
+    tst_assert(KMEM_TYPED_SLAB_SIZE(typed_small_t, 16) == BLOCK_SIZE);
+    tst_assert(KMEM_TYPED_SLAB_SIZE(typed_big_t, 0) > BLOCK_SIZE);
+
+    const int numObjects = 1000;
+    typed_small_t **small = malloc(numObjects * sizeof(typed_small_t *));
+    typed_big_t **big = malloc(numObjects / 10 * sizeof(typed_big_t *));
+    for (int i = 0; i < numObjects; i++)
+    {
+        small[i] = typed_small_alloc();
+        tst_assert(small[i] && (size_t)small[i] % 16 == 0);
+        small[i]->key = i;
+        if (i % 10 == 0)
+        {
+            big[i / 10] = typed_big_alloc();
+            tst_assert(big[i / 10]);
+            memset(big[i / 10], i, sizeof(typed_big_t));
+        }
+    }
+    for (int i = 0; i < numObjects; i++)
+    {
+        tst_assert(small[i]->key == i);
+    }
+
+    // Every other object goes back, half of them through the generic path
+    for (int i = 0; i < numObjects; i += 2)
+    {
+        if (i % 4)
+            kmem_cache_free(typed_small_cachep, small[i]);
+        else
+            typed_small_free(small[i]);
+    }
+    for (int i = 0; i < numObjects; i += 2)
+    {
+        small[i] = typed_small_alloc();
+        tst_assert(small[i]);
+    }
+    for (int i = 0; i < numObjects; i++)
+    {
+        typed_small_free(small[i]);
+        if (i % 10 == 0)
+            typed_big_free(big[i / 10]);
+    }
+
+    tst_assert(!typed_small_cachep->pSlab[FULL] && !typed_small_cachep->pSlab[HAS_SPACE]);
+    tst_assert(!typed_big_cachep->pSlab[FULL] && !typed_big_cachep->pSlab[HAS_SPACE]);
+
+    // Double, interior and foreign frees are refused like on the generic path
+    typed_small_t *obj = typed_small_alloc();
+    kmem_slab_t *slab = buddy_block_start(obj);
+    typed_small_free(obj);
+    tst_OK(typed_small_cachep->errorFlags);
+    typed_small_free(obj);
+    tst_assert(typed_small_cachep->errorFlags == SLAB_DEALLOC_NOT_VALID_ADDRES);
+    obj = typed_small_alloc();
+    typed_small_free((typed_small_t *)((char *)obj + 8));
+    tst_assert(typed_small_cachep->errorFlags == SLAB_DEALLOC_NOT_VALID_ADDRES);
+    typed_small_t *foreign = kmalloc(KMEM_TYPED_OBJECT_SIZE(typed_small_t, 16));
+    typed_small_free(foreign);
+    tst_assert(typed_small_cachep->errorFlags == SLAB_DEALLOC_OBJECT_NOT_IN_SLAB);
+    tst_assert(slab->takenSlots == 1);
+    kfree(foreign);
+
+    // Large buffer that looks like a slab of the cache with one object taken is never read as one
+    char *large = kmalloc((1 << BUFFER_SIZE_MAX) + 1);
+    kmem_slab_t *fake = (kmem_slab_t *)large;
+    memcpy(fake, slab, sizeof(kmem_slab_t));
+    fake->memStart = large + 256;
+    fake->pBitmap = (BitMapEntry *)(fake + 1);
+    fake->pBitmap[0] = 0;
+    fake->takenSlots = 1;
+    typed_small_free((typed_small_t *)fake->memStart);
+    tst_assert(typed_small_cachep->errorFlags == SLAB_DEALLOC_OBJECT_NOT_IN_SLAB);
+    tst_assert(fake->takenSlots == 1);
+    kfree(large);
+    typed_small_free(obj);
+    tst_assert(slab->takenSlots == 0);
+
+    free(small);
+    free(big);
+    typed_small_cache_destroy();
+    typed_big_cache_destroy();
+}
+SLAB_TEST_END
+
 TEST_SUITE_START(cache, 1024 * 16)
 {
     const size_t Obj_Size = 1;
@@ -142,5 +688,15 @@ TEST_SUITE_START(cache, 1024 * 16)
     SUITE_ADD_OBJSIZE(cache_create_delete, Obj_Size);
     SUITE_ADD_OBJSIZE(cache_alloc_free, Obj_Size);
     SUITE_ADD_OBJSIZE(cache_create_alloc_delete_destructor, Obj_Size);
+    SUITE_ADD_OBJSIZE(cache_lock_stats, Obj_Size);
+    SUITE_ADD_OBJSIZE(cache_aligned, Obj_Size);
+    SUITE_ADD_OBJSIZE(cache_reclaim, 1000);
+    SUITE_ADD_OBJSIZE(cache_reclaim_unlocked, 1000);
+    SUITE_ADD_OBJSIZE(cache_reclaimer, Obj_Size);
+    SUITE_ADD_OBJSIZE(cache_defrag, 64);
+    SUITE_ADD_OBJSIZE(cache_alloc_hint, 64);
+    SUITE_ADD_OBJSIZE(cache_zalloc, 100);
+    SUITE_ADD_OBJSIZE(cache_foreign_free, 64);
+    SUITE_ADD_OBJSIZE(cache_typed, Obj_Size);
 }
 TEST_SUITE_END
@@ -1,4 +1,5 @@
 #include "helper.h"
+#include <windows.h>
 
 bool suite_buddy();
 bool suite_buddy_2();
@@ -7,6 +8,9 @@ bool suite_cache();
 
 int main(int argc, char const *argv[])
 {
+    // Slabs are handed out per CPU, keep tests on one CPU so slab lists are deterministic
+    SetThreadAffinityMask(GetCurrentThread(), 1);
+
     int cnt = 4;
     cnt -= suite_buddy();
     cnt -= suite_buddy_2();
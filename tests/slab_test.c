@@ -4,6 +4,7 @@
 #include "slab.h"
 #include "slab_impl.h"
 #include "tests.h"
+#include <string.h>
 
 extern kmem_buffer_t *s_bufferHead;
 
@@ -15,17 +16,11 @@ SLAB_TEST_START(get_slab_pow_two)
     BitMapEntry *bitmap = slab->pBitmap;
     int cnt = 0;
 
-    for (int i = 0; i < slab->numBitMapEntry; i++)
+    for (int i = 0; i < SLAB_BITMAP_USED_ENTRIES(slab); i++)
     {
-        int n = 1 << sizeof(BitMapEntry) * CHAR_BIT;
-        BitMapEntry num = slab->pBitmap[i];
-        while (n)
-        {
-            cnt += num & 1;
-            num >>= 1;
-            n >>= 1;
-        }
+        cnt += POPCOUNT64(slab->pBitmap[i]);
     }
+    cnt += NUMBER_OF_OBJECTS_IN_SLAB(slab) - slab->frontier;
     tst_assert(cnt == NUMBER_OF_OBJECTS_IN_SLAB(slab));
 }
 SLAB_TEST_END
@@ -47,6 +42,37 @@ SLAB_TEST_START(full_alloc_slab)
 }
 SLAB_TEST_END
 
+SLAB_TEST_START(lazy_frontier)
+{
+    kmem_slab_t *slab;
+    size_t l1Offset = 0;
+    tst_OK(get_slab(objSize, &l1Offset, &slab));
+    tst_assert(slab->frontier == 0);
+    const int numBlocks = NUMBER_OF_OBJECTS_IN_SLAB(slab);
+    void *ptr[BLOCK_SIZE];
+    for (int i = 0; i < numBlocks / 2; i++)
+    {
+        tst_OK(slab_allocate(slab, &ptr[i]));
+        tst_assert(ptr[i] == (void *)((size_t)slab->memStart + i * objSize));
+        tst_assert(slab->frontier == i + 1);
+    }
+
+    // Freed slot is reused only once never used slots run out
+    tst_OK(slab_free(slab, ptr[0]));
+    tst_FAIL(slab_free(slab, ptr[0]));
+    tst_FAIL(slab_free(slab, (void *)((size_t)slab->memStart + (numBlocks - 1) * objSize)));
+    for (int i = numBlocks / 2; i < numBlocks; i++)
+    {
+        tst_OK(slab_allocate(slab, &ptr[i]));
+        tst_assert(ptr[i] != ptr[0]);
+    }
+    tst_OK(slab_allocate(slab, &ptr[0]));
+    tst_assert(ptr[0] == slab->memStart);
+    tst_FAIL(slab_allocate(slab, &ptr[0]));
+    tst_assert(slab->takenSlots == numBlocks);
+}
+SLAB_TEST_END
+
 SLAB_TEST_START(alloc_dealloc)
 {
     kmem_slab_t *slab;
@@ -105,26 +131,21 @@ SLAB_TEST_START(big_slab_alloc)
     BitMapEntry *bitmap = slab->pBitmap;
     int cnt = 0;
 
-    for (int i = 0; i < slab->numBitMapEntry; i++)
+    for (int i = 0; i < SLAB_BITMAP_USED_ENTRIES(slab); i++)
     {
-        int n = 1 << sizeof(BitMapEntry) * CHAR_BIT;
-        BitMapEntry num = slab->pBitmap[i];
-        while (n)
-        {
-            cnt += num & 1;
-            num >>= 1;
-            n >>= 1;
-        }
+        cnt += POPCOUNT64(slab->pBitmap[i]);
     }
+    cnt += NUMBER_OF_OBJECTS_IN_SLAB(slab) - slab->frontier;
     tst_assert(cnt == NUMBER_OF_OBJECTS_IN_SLAB(slab));
 }
 SLAB_TEST_END
 
 SLAB_TEST_START(kmalloc_test_one)
 {
+    kmem_thread_cache_enable(0); // Test inspects class slab lists
     void *prev = kmalloc(objSize);
-    const int entryId = BEST_FIT_BLOCKID(objSize) - 5;
-    tst_assert(entryId >= 0 && entryId <= 12);
+    const int entryId = kmalloc_index(objSize);
+    tst_assert(entryId >= 0 && entryId < BUFFER_ENTRY_NUM);
     tst_assert(prev);
 
     for (int i = 1; i < _numberOfObjectsInSlab; i++)
@@ -142,8 +163,9 @@ SLAB_TEST_END
 
 SLAB_TEST_START(kmalloc_test_lvlup)
 {
+    kmem_thread_cache_enable(0); // Test inspects class slab lists
     const size_t num_pages_to_alloc = 5;
-    const int entryId = BEST_FIT_BLOCKID(objSize) - 5;
+    const int entryId = kmalloc_index(objSize);
     if (objSize + sizeof(kmem_slab_t) > BLOCK_SIZE)
         return true;
     for (int j = 0; j < num_pages_to_alloc; j++)
@@ -165,8 +187,9 @@ SLAB_TEST_END
 
 SLAB_TEST_START(kmalloc_kfree)
 {
-    const int entryId = BEST_FIT_BLOCKID(objSize) - 5;
-    tst_assert(entryId >= 0 && entryId <= 12);
+    kmem_thread_cache_enable(0); // Test inspects class slab lists
+    const int entryId = kmalloc_index(objSize);
+    tst_assert(entryId >= 0 && entryId < BUFFER_ENTRY_NUM);
     void *ptr[BLOCK_SIZE];
     for (int i = 0; i < _numberOfObjectsInSlab; i++)
     {
@@ -188,25 +211,62 @@ SLAB_TEST_START(kmalloc_kfree)
 }
 SLAB_TEST_END
 
+SLAB_TEST_START(kmalloc_small)
+{
+    kmem_thread_cache_enable(0); // Test inspects class slab lists
+    for (size_t size = 1; size <= 32; size++)
+    {
+        tst_assert(kmalloc_class_size(kmalloc_index(size)) == ALIGN_UP(size, 8));
+    }
+    tst_assert(kmalloc_class_size(kmalloc_index(33)) == 64);
+    tst_assert(kmalloc_index(0) == -1);
+
+    const int entryId = kmalloc_index(objSize);
+    const int ITER = 600;
+    void *ptr[600];
+    for (int i = 0; i < ITER; i++)
+    {
+        ptr[i] = kmalloc(objSize);
+        tst_assert(ptr[i]);
+        for (int j = 0; j < i; j++)
+        {
+            const size_t diff = ptr[i] > ptr[j] ? (size_t)ptr[i] - (size_t)ptr[j] : (size_t)ptr[j] - (size_t)ptr[i];
+            tst_assert(diff >= objSize);
+        }
+    }
+
+    // Header and bitmap must not dominate slabs of tiny objects
+    kmem_slab_t *slab = s_bufferHead[entryId].pSlab[FULL];
+    tst_assert(slab);
+    tst_assert(NUMBER_OF_OBJECTS_IN_SLAB(slab) * objSize >= slab->slabSize * 9 / 10);
+
+    for (int i = 0; i < ITER; i++)
+    {
+        kfree(ptr[i]);
+    }
+}
+SLAB_TEST_END
+
 SLAB_TEST_START(l1_cache)
 {
     kmem_cache_t *cache = kmem_cache_create("L1_Cache_Test", Obj_Size, NULL, NULL);
-    const int ITER = 10;
-    const size_t notUsedMemory = (BLOCK_SIZE - sizeof(kmem_slab_t)) % Obj_Size;
-    size_t unused = 0;
+    const size_t colors = cache->layout.colorCount;
+    const int ITER = colors + 1;
+    tst_assert(colors > 1);
     const void **ptr = (void **)malloc(ITER * _numberOfObjectsInSlab * sizeof(void *));
-    for (int i = 0; i < 2; i++)
+    for (int i = 0; i < ITER; i++)
     {
         for (int j = 0; j < _numberOfObjectsInSlab; j++)
         {
             ptr[i * _numberOfObjectsInSlab + j] = kmem_cache_alloc(cache);
         }
-        unused += CACHE_L1_LINE_SIZE;
-        if (unused > notUsedMemory)
-        {
-            unused = 0;
-        }
-        tst_assert(unused == cache->l1CacheFiller);
+        kmem_slab_t *slab = cache->pSlab[FULL];
+        tst_assert(slab);
+        const size_t offset =
+            (size_t)slab->memStart - (size_t)slab->pBitmap - slab->numBitMapEntry * sizeof(BitMapEntry);
+        tst_assert(offset == (i % colors) * cache->layout.colorStride);
+        tst_assert((size_t)ptr[(i + 1) * _numberOfObjectsInSlab - 1] + Obj_Size <= (size_t)slab + slab->slabSize);
+        tst_assert(cache->layout.colorNext == (i + 1) % colors);
     }
 
     for (int i = 0; i < ITER; i++)
@@ -216,24 +276,311 @@ SLAB_TEST_START(l1_cache)
             kmem_cache_free(cache, ptr[i * _numberOfObjectsInSlab + j]);
         }
     }
-    tst_assert(unused == cache->l1CacheFiller);
+    tst_OK(cache->errorFlags);
 
     free(ptr);
 }
 SLAB_TEST_END
 
+SLAB_TEST_START(slab_layout_colors)
+{
+    for (size_t size = 1; size <= 2 * BLOCK_SIZE; size++)
+    {
+        kmem_slab_layout_t layout;
+        tst_OK(slab_layout_init(&layout, size, 0, SLAB_COLOR_L1));
+        tst_assert(layout.colorCount >= 1);
+
+        const size_t bitmap = slab_bitmap_entries(layout.slabSize, size) * sizeof(BitMapEntry);
+        const size_t numObjects = (layout.slabSize - sizeof(kmem_slab_t) - bitmap) / size;
+        tst_assert(numObjects >= 1);
+        tst_assert(sizeof(kmem_slab_t) + bitmap + (layout.colorCount - 1) * layout.colorStride + numObjects * size <=
+                   layout.slabSize);
+    }
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(reciprocal_free)
+{
+    for (size_t size = 1; size <= 2 * BLOCK_SIZE; size++)
+    {
+        kmem_slab_layout_t layout;
+        tst_OK(slab_layout_init(&layout, size, 0, SLAB_COLOR_NONE));
+        for (size_t id = 0; id * size < layout.slabSize; id++)
+        {
+            tst_assert(RECIPROCAL_DIVIDE(id * size, layout.reciprocal, layout.reciprocalShift) == id);
+            if (size > 1)
+                tst_assert(RECIPROCAL_DIVIDE(id * size + size - 1, layout.reciprocal, layout.reciprocalShift) == id);
+        }
+    }
+
+    // Pointers inside an object are not objects
+    size_t l1Offset = 0;
+    kmem_slab_t *slab;
+    void *ptr;
+    tst_OK(get_slab(Obj_Size, &l1Offset, &slab));
+    tst_OK(slab_allocate(slab, &ptr));
+    tst_OK(slab_allocate(slab, &ptr));
+    tst_FAIL(slab_free(slab, (void *)((size_t)ptr + 1)));
+    tst_FAIL(slab_free(slab, (void *)((size_t)ptr + Obj_Size - 1)));
+    tst_assert(slab->takenSlots == 2);
+    tst_OK(slab_free(slab, ptr));
+    tst_assert(slab->takenSlots == 1);
+    delete_slab(slab);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(kmalloc_large)
+{
+    const size_t Size = (1 << BUFFER_SIZE_MAX) * 3 / 2 + 1;
+    char *ptr = kmalloc(Size);
+    tst_assert(ptr);
+    tst_assert((size_t)ptr % BLOCK_SIZE == 0);
+    memset(ptr, 0xA5, Size);
+
+    void *small = kmalloc(objSize);
+    tst_assert(small);
+    kfree(small);
+
+    tst_assert(buddy_usable_size(ptr) >= Size);
+    kfree(ptr);
+    tst_assert(buddy_usable_size(ptr) == 0);
+
+    ptr = kmalloc(Size);
+    tst_assert(ptr);
+    kfree(ptr);
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(ksize_krealloc)
+{
+    char *ptr = kmalloc(20);
+    tst_assert(ksize(ptr) == 24);
+    memset(ptr, 0x5A, 20);
+    tst_assert(krealloc(ptr, 24) == ptr);
+    tst_assert(krealloc(ptr, 8) == ptr);
+
+    char *grown = krealloc(ptr, 100);
+    tst_assert(grown && grown != ptr);
+    tst_assert(ksize(grown) == 128);
+    for (int i = 0; i < 20; i++)
+        tst_assert(grown[i] == 0x5A);
+
+    // Exact large buffer leaves its tail blocks free, growing takes them back in place
+    const size_t Size = (1 << BUFFER_SIZE_MAX) + 1;
+    char *large = krealloc(grown, Size);
+    tst_assert(large && (size_t)large % BLOCK_SIZE == 0);
+    tst_assert(ksize(large) >= Size);
+    for (int i = 0; i < 20; i++)
+        tst_assert(large[i] == 0x5A);
+    memset(large, 0xA5, Size);
+    // Pointers into a large buffer are not slab objects, whatever the buffer holds
+    tst_assert(ksize(large + BLOCK_SIZE) == 0);
+    kfree(large + BLOCK_SIZE);
+    tst_assert(ksize(large) >= Size);
+    tst_assert(krealloc(large, Size * 3 / 2) == large);
+    tst_assert(ksize(large) >= Size * 3 / 2);
+    kfree(large);
+
+    ptr = krealloc(NULL, objSize);
+    tst_assert(ptr && ksize(ptr) >= objSize);
+    tst_assert(!krealloc(ptr, 0));
+    tst_assert(!ksize(NULL));
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(kmalloc_class)
+{
+    // Constant and variable sizes land in the same class
+    volatile size_t size = 40;
+    void *constant = kmalloc(40);
+    void *variable = kmalloc(size);
+    tst_assert(constant && variable);
+    tst_assert(ksize(constant) == 64 && ksize(variable) == 64);
+    kfree(constant);
+    kfree(variable);
+
+    for (int i = 0; i < BUFFER_ENTRY_NUM; i++)
+    {
+        void *ptr = kmalloc_class(i);
+        tst_assert(ptr && ksize(ptr) == kmalloc_class_size(i));
+        kfree(ptr);
+    }
+    tst_assert(!kmalloc_class(-1) && !kmalloc_class(BUFFER_ENTRY_NUM));
+
+    // Constant sizes above the largest class still go to buddy
+    void *large = kmalloc((1 << BUFFER_SIZE_MAX) + 1);
+    tst_assert(large && (size_t)large % BLOCK_SIZE == 0);
+    kfree(large);
+    tst_assert(!kmalloc(0));
+}
+SLAB_TEST_END
+
+SLAB_TEST_START(kzalloc_dirty)
+{
+    const size_t Sizes[] = {objSize, (1 << BUFFER_SIZE_MAX) + 1};
+    for (int s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); s++)
+    {
+        char *ptr = kmalloc(Sizes[s]);
+        tst_assert(ptr);
+        memset(ptr, 0xFF, Sizes[s]);
+        kfree(ptr);
+
+        ptr = kzalloc(Sizes[s]);
+        tst_assert(ptr);
+        for (size_t i = 0; i < Sizes[s]; i++)
+            tst_assert(!ptr[i]);
+        kfree(ptr);
+    }
+    tst_assert(!kzalloc(0));
+}
+SLAB_TEST_END
+
+// Objects of a class taken out of its slabs, thread lists included
+static int buffer_taken(int entryId)
+{
+    kmem_buffer_t *buffer = &s_bufferHead[entryId];
+    int taken = 0;
+    for (int l = 0; l < NUM_TYPES; l++)
+        for (kmem_slab_t *slab = buffer->pSlab[l]; slab; slab = slab->next)
+            taken += slab->takenSlots;
+    for (int c = 0; c < KMEM_MAX_CPUS; c++)
+    {
+        if (buffer->cpuSlab[c].pActive)
+            taken += buffer->cpuSlab[c].pActive->takenSlots;
+        for (kmem_slab_t *slab = buffer->cpuSlab[c].pPartial; slab; slab = slab->next)
+            taken += slab->takenSlots;
+    }
+    return taken;
+}
+
+#define THREAD_CACHE_THREADS 4
+#define THREAD_CACHE_OBJECTS 1000
+
+static DWORD WINAPI thread_cache_main(LPVOID arg)
+{
+    const size_t size = *(const size_t *)arg;
+    void *ptr[THREAD_CACHE_OBJECTS];
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < THREAD_CACHE_OBJECTS; i++)
+            ptr[i] = kmalloc(size);
+        for (int i = 0; i < THREAD_CACHE_OBJECTS; i++)
+            kfree(ptr[i]);
+    }
+    return 0;
+}
+
+// Frees every buffer of the array, which other threads free too
+static DWORD WINAPI thread_cache_double_main(LPVOID arg)
+{
+    void **ptr = (void **)arg;
+    for (int i = 0; i < THREAD_CACHE_OBJECTS; i++)
+        kfree(ptr[i]);
+    return 0;
+}
+
+SLAB_TEST_START(thread_cache)
+{
+    const int entryId = kmalloc_index(objSize);
+
+    // kfree only records the buffer, it goes back to its slab with the thread's batch
+    void *ptr = kmalloc(objSize);
+    tst_assert(ptr);
+    kfree(ptr);
+    tst_assert(buffer_taken(entryId) > 0);
+    kmem_thread_cache_flush();
+    tst_assert(buffer_taken(entryId) == 0);
+
+    // Exiting threads give their leftovers back
+    HANDLE handles[THREAD_CACHE_THREADS];
+    for (int t = 0; t < THREAD_CACHE_THREADS; t++)
+        handles[t] = CreateThread(NULL, 0, thread_cache_main, (LPVOID)&objSize, 0, NULL);
+    for (int t = 0; t < THREAD_CACHE_THREADS; t++)
+    {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+    }
+    tst_assert(buffer_taken(entryId) == 0);
+
+    // Running out of memory drains the lists of the thread that asks for more
+    ptr = kmalloc(objSize);
+    kfree(ptr);
+    tst_assert(buffer_taken(entryId) > 0);
+    kmem_cache_t *hog = kmem_cache_create("Hog", BLOCK_SIZE / 2, NULL, NULL);
+    while (kmem_cache_alloc(hog))
+        ;
+    tst_assert(buffer_taken(entryId) == 0);
+    kmem_cache_destroy(hog);
+
+    // Disabled caches go straight to the class
+    tst_assert(kmem_thread_cache_enable(0));
+    ptr = kmalloc(objSize);
+    tst_assert(buffer_taken(entryId) == 1);
+    kfree(ptr);
+    tst_assert(buffer_taken(entryId) == 0);
+    tst_assert(!kmem_thread_cache_enable(1));
+
+    // Double, interior and foreign frees are refused in any build, also within one batch
+    ptr = kmalloc(objSize);
+    void *other = kmalloc(objSize);
+    kmem_cache_t *cache = kmem_cache_create("NotKmalloc", objSize, NULL, NULL);
+    void *foreign = kmem_cache_alloc(cache);
+    kfree(ptr);
+    kfree(ptr);
+    kfree((char *)other + 8);
+    kfree(foreign);
+    kmem_thread_cache_flush();
+    tst_assert(buffer_taken(entryId) == 1);
+    tst_assert(((kmem_slab_t *)buddy_block_start(foreign))->takenSlots == 1);
+    kfree(other);
+    kmem_thread_cache_flush();
+    kfree(ptr);
+    kmem_thread_cache_flush();
+    tst_assert(buffer_taken(entryId) == 0);
+    kmem_cache_free(cache, foreign);
+    kmem_cache_destroy(cache);
+
+    // Threads freeing the same buffers at once free each of them once
+    void **shared = kmalloc(THREAD_CACHE_OBJECTS * sizeof(void *));
+    for (int i = 0; i < THREAD_CACHE_OBJECTS; i++)
+        shared[i] = kmalloc(objSize);
+    kmem_thread_cache_flush();
+    for (int t = 0; t < THREAD_CACHE_THREADS; t++)
+        handles[t] = CreateThread(NULL, 0, thread_cache_double_main, shared, 0, NULL);
+    for (int t = 0; t < THREAD_CACHE_THREADS; t++)
+    {
+        WaitForSingleObject(handles[t], INFINITE);
+        CloseHandle(handles[t]);
+    }
+    tst_assert(buffer_taken(entryId) == 0);
+    kfree(shared);
+    kmem_thread_cache_flush();
+}
+SLAB_TEST_END
+
 TEST_SUITE_START(slab, 1024)
 {
     const size_t Obj_Size = 32;
 
     SUITE_ADD_OBJSIZE(get_slab_pow_two, Obj_Size);
     SUITE_ADD_OBJSIZE(full_alloc_slab, Obj_Size);
+    SUITE_ADD_OBJSIZE(lazy_frontier, Obj_Size);
     SUITE_ADD_OBJSIZE(alloc_dealloc, Obj_Size);
     SUITE_ADD_OBJSIZE(alloc_dealloc_mod, Obj_Size);
     SUITE_ADD_OBJSIZE(big_slab_alloc, Obj_Size);
     SUITE_ADD_OBJSIZE(kmalloc_test_one, Obj_Size);
     SUITE_ADD_OBJSIZE(kmalloc_test_lvlup, Obj_Size);
     SUITE_ADD_OBJSIZE(kmalloc_kfree, Obj_Size);
+    SUITE_ADD_OBJSIZE(kmalloc_small, 8);
+    SUITE_ADD_OBJSIZE(kmalloc_small, 24);
     SUITE_ADD_OBJSIZE(l1_cache, 300);
+    SUITE_ADD_OBJSIZE(slab_layout_colors, Obj_Size);
+    SUITE_ADD_OBJSIZE(reciprocal_free, 24);
+    SUITE_ADD_OBJSIZE(reciprocal_free, 100);
+    SUITE_ADD_OBJSIZE(kmalloc_large, Obj_Size);
+    SUITE_ADD_OBJSIZE(ksize_krealloc, Obj_Size);
+    SUITE_ADD_OBJSIZE(kzalloc_dirty, Obj_Size);
+    SUITE_ADD_OBJSIZE(kmalloc_class, Obj_Size);
+    SUITE_ADD_OBJSIZE(thread_cache, Obj_Size);
 }
 TEST_SUITE_END
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Converts binary dump written by trace_dump() to text or Chrome trace JSON
+// Usage: trace_decode [--json] <trace file>
+
+#define TRACE_EVENT_NAME(name) #name,
+static const char *const s_eventNames[TRACE_NUM_EVENTS] = {TRACE_EVENT_LIST(TRACE_EVENT_NAME)};
+#undef TRACE_EVENT_NAME
+
+static const char *event_name(uint16_t event)
+{
+    return event < TRACE_NUM_EVENTS ? s_eventNames[event] : "UNKNOWN";
+}
+
+static void print_text(const trace_record_t *record, double usec)
+{
+    printf("%14.3f us  tid %-8u %-14s 0x%llx %llu\n", usec, record->threadId, event_name(record->event),
+           (unsigned long long)record->arg0, (unsigned long long)record->arg1);
+}
+
+static void print_json(const trace_record_t *record, double usec, bool first)
+{
+    printf("%s\n  {\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 0, \"tid\": %u, "
+           "\"args\": {\"arg0\": \"0x%llx\", \"arg1\": %llu}}",
+           first ? "" : ",", event_name(record->event), usec, record->threadId, (unsigned long long)record->arg0,
+           (unsigned long long)record->arg1);
+}
+
+// Rings of different threads are dumped one after another, records are put back in time order
+static int compare_records(const void *left, const void *right)
+{
+    const uint64_t a = ((const trace_record_t *)left)->timestamp;
+    const uint64_t b = ((const trace_record_t *)right)->timestamp;
+    return a < b ? -1 : a > b;
+}
+
+int main(int argc, char const *argv[])
+{
+    bool json = false;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else
+            path = argv[i];
+    }
+
+    if (!path)
+    {
+        fprintf(stderr, "Usage: %s [--json] <trace file>\n", argv[0]);
+        return PARAM_ERROR;
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Can't open %s\n", path);
+        return PARAM_ERROR;
+    }
+
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_FILE_MAGIC ||
+        header.version != TRACE_FILE_VERSION || header.recordSize != sizeof(trace_record_t) ||
+        !header.timestampFrequency)
+    {
+        fprintf(stderr, "%s is not a trace file\n", path);
+        fclose(file);
+        return FAIL;
+    }
+
+    // Record count comes from the file, it must fit both the file and the size of an allocation
+    const long dataStart = ftell(file);
+    fseek(file, 0, SEEK_END);
+    const long fileSize = ftell(file);
+    fseek(file, dataStart, SEEK_SET);
+    const uint64_t available =
+        dataStart >= 0 && fileSize >= dataStart ? (uint64_t)(fileSize - dataStart) / sizeof(trace_record_t) : 0;
+    if (header.numRecords > available || header.numRecords > SIZE_MAX / sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s is truncated, header has %llu records but file holds %llu\n", path,
+                (unsigned long long)header.numRecords, (unsigned long long)available);
+        fclose(file);
+        return FAIL;
+    }
+
+    const size_t numRecords = (size_t)header.numRecords;
+    trace_record_t *records = numRecords ? (trace_record_t *)malloc(numRecords * sizeof(trace_record_t)) : NULL;
+    if (numRecords && !records)
+    {
+        fprintf(stderr, "Not enough memory for %llu records\n", (unsigned long long)header.numRecords);
+        fclose(file);
+        return NOT_ENOUGH_MEMORY;
+    }
+    if (fread(records, sizeof(trace_record_t), numRecords, file) != numRecords)
+    {
+        fprintf(stderr, "Can't read records of %s\n", path);
+        free(records);
+        fclose(file);
+        return FAIL;
+    }
+    qsort(records, numRecords, sizeof(trace_record_t), compare_records);
+
+    if (json)
+        printf("{\"traceEvents\": [");
+
+    const uint64_t start = numRecords ? records[0].timestamp : 0;
+    for (size_t i = 0; i < numRecords; i++)
+    {
+        const double usec = (double)(records[i].timestamp - start) * 1000000.0 / header.timestampFrequency;
+        if (json)
+            print_json(&records[i], usec, i == 0);
+        else
+            print_text(&records[i], usec);
+    }
+
+    if (json)
+        printf("\n]}\n");
+
+    free(records);
+    fclose(file);
+    return OK;
+}